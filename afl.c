@@ -31,28 +31,28 @@ void dump(uint8_t *src, uint32_t len);
 /*
   directory ops
   m path
-int stfs_mkdir(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *path);
+int stfs_mkdir(STFS_Volume *vol, uint8_t *path);
   ctx=l path
-int opendir(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *path, ReaddirCTX *ctx);
+int opendir(STFS_Volume *vol, uint8_t *path, ReaddirCTX *ctx);
   inode=n ctx
-const Inode_t* readdir(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], ReaddirCTX *ctx);
+const Inode_t* readdir(STFS_Volume *vol, ReaddirCTX *ctx);
   x path
-int stfs_rmdir(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *path);
+int stfs_rmdir(STFS_Volume *vol, uint8_t *path);
   file ops
   fd=o path flags
-int stfs_open(uint8_t *path, int oflag, Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK]);
+int stfs_open(uint8_t *path, int oflag, STFS_Volume *vol);
   w fd buf size
-ssize_t stfs_write(int fildes, const void *buf, size_t nbyte, Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK]);
+ssize_t stfs_write(int fildes, const void *buf, size_t nbyte, STFS_Volume *vol);
   r fd buf size
-ssize_t stfs_read(int fildes, void *buf, size_t nbyte, Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK]);
+ssize_t stfs_read(int fildes, void *buf, size_t nbyte, STFS_Volume *vol);
   s off whence
-off_t stfs_lseek(int fildes, off_t offset, int whence);
+off_t stfs_lseek(int fildes, off_t offset, int whence, STFS_Volume *vol);
   c fd
-int stfs_close(int fildes, Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK]);
+int stfs_close(int fildes, STFS_Volume *vol);
   d path
-int stfs_unlink(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *path);
+int stfs_unlink(STFS_Volume *vol, uint8_t *path);
   t path size
-int stfs_truncate(uint8_t *path, int length, Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK]);
+int stfs_truncate(uint8_t *path, int length, STFS_Volume *vol);
 
 
       m path
@@ -77,6 +77,7 @@ void handler(int signo) {
 }
 
 Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK];
+STFS_Volume vol=STFS_VOLUME(blocks);
 int _main(void) {
   printf("AFL test harness\n");
   memset(&blocks,0xff,sizeof(blocks));
@@ -88,7 +89,7 @@ int _main(void) {
   sa.sa_flags = 0;
   sigaction(SIGALRM, &sa, NULL);
 
-  if(stfs_init(blocks)==-1) {
+  if(stfs_init(&vol)==-1) {
     return 0;
   };
 
@@ -108,7 +109,7 @@ int _main(void) {
       if((n=fread(path, 1, cmd_size, stdin))!=cmd_size) return 0;
       //alarm(0);
       path[n]=0;
-      fprintf(stderr,"mkdir %s returns: %d\n", path, stfs_mkdir(blocks, path));
+      fprintf(stderr,"mkdir %s returns: %d\n", path, stfs_mkdir(&vol, path));
       break;
     };
     case('l'): { /*ctx=opendir path*/ };
@@ -122,7 +123,7 @@ int _main(void) {
       if((n=fread(path, 1, cmd_size, stdin))!=cmd_size) return 0;
       //alarm(0);
       path[n]=0;
-      fprintf(stderr,"rmdir '%s' returns: %d\n", path, stfs_rmdir(blocks, path));
+      fprintf(stderr,"rmdir '%s' returns: %d\n", path, stfs_rmdir(&vol, path));
       break;
     };
     case('o'): { /*open flags path */
@@ -136,7 +137,7 @@ int _main(void) {
       if((n=fread(path, 1, cmd_size, stdin))!=cmd_size) return 0;
       //alarm(0);
       path[n]=0;
-      fprintf(stderr,"open '%s' %d returns: %d\n", path, oflags, stfs_open(path, oflags, blocks));
+      fprintf(stderr,"open '%s' %d returns: %d\n", path, oflags, stfs_open(path, oflags, &vol));
       break;
     };
     case('w'): { /*write fd buf*/
@@ -149,7 +150,7 @@ int _main(void) {
       uint8_t buf[cmd_size+1];
       int n;
       for(n=0;n<cmd_size;n++) buf[n]=n%256;
-      fprintf(stderr,"write %dB -> %d returns: %d\n", cmd_size, fd, stfs_write(fd, buf, cmd_size, blocks));
+      fprintf(stderr,"write %dB -> %d returns: %d\n", cmd_size, fd, stfs_write(fd, buf, cmd_size, &vol));
       break;
     };
     case('r'): { /*read fd size*/
@@ -161,7 +162,7 @@ int _main(void) {
       //alarm(0);
       uint8_t buf[cmd_size+1];
       int ret;
-      fprintf(stderr,"read %dB from %d returns: %d\n", cmd_size, fd, (ret=stfs_read(fd, buf, cmd_size, blocks)));
+      fprintf(stderr,"read %dB from %d returns: %d\n", cmd_size, fd, (ret=stfs_read(fd, buf, cmd_size, &vol)));
       //if(ret>0) dump(buf,ret);
       break;
     }
@@ -170,7 +171,7 @@ int _main(void) {
       //alarm(1);
       if(fscanf(stdin, "%d %d %d", &fd, &off, &whence)!=3) return 0;
       //alarm(0);
-      fprintf(stderr,"seek %d %d %d returns: %d\n", fd, off, whence, stfs_lseek(fd, off, whence));
+      fprintf(stderr,"seek %d %d %d returns: %d\n", fd, off, whence, stfs_lseek(fd, off, whence, &vol));
       break;
     };
     case('c'): { /*close fd */
@@ -178,7 +179,7 @@ int _main(void) {
       //alarm(1);
       if(fscanf(stdin, "%d", &fd)!=1) return 0;
       //alarm(0);
-      fprintf(stderr,"close %d returns: %d\n", fd, stfs_close(fd, blocks));
+      fprintf(stderr,"close %d returns: %d\n", fd, stfs_close(fd, &vol));
       break;
     };
     case('d'): { /*unlink path */
@@ -190,7 +191,7 @@ int _main(void) {
       if((n=fread(path, 1, cmd_size, stdin))!=cmd_size) return 0;
       //alarm(0);
       path[n]=0;
-      fprintf(stderr,"unlink '%s' returns: %d\n", path, stfs_unlink(blocks, path));
+      fprintf(stderr,"unlink '%s' returns: %d\n", path, stfs_unlink(&vol, path));
       break;
     };
     case('t'): { /*truncate size path */
@@ -204,11 +205,11 @@ int _main(void) {
       if((n=fread(path, 1, cmd_size, stdin))!=cmd_size) return 0;
       //alarm(0);
       path[n]=0;
-      fprintf(stderr,"truncate %d '%s' returns: %d\n", size, path, stfs_truncate(path, size, blocks));
+      fprintf(stderr,"truncate %d '%s' returns: %d\n", size, path, stfs_truncate(path, size, &vol));
       break;
     };
     case('p'): {
-      if(stfs_init(blocks)==-1) {
+      if(stfs_init(&vol)==-1) {
         return 0;
       };
       fprintf(stderr,"reset device\n");
@@ -226,11 +227,11 @@ int _main(void) {
   return 0;
 }
 
-void dump_info(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK]);
+void dump_info(STFS_Volume *vol);
 
 int main(void) {
   _main();
-  dump_info(blocks);
+  dump_info(&vol);
   int fd;
   fd=open("test.img", O_RDWR | O_CREAT | O_TRUNC, 0666 );
   fprintf(stderr, "[i] dumping fs to fd %d\n", fd);
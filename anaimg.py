@@ -2,7 +2,7 @@
 
 import sys
 from binascii import hexlify
-from stfs import Chunk
+from stfs import Chunk, inode_size, CHUNK_SIZE, CHUNKS_PER_BLOCK, DATA_PER_CHUNK
 
 dirs=set([''])
 files=set()
@@ -32,10 +32,10 @@ def dump_chunks(prev):
     elif prev[0]=='x':
         print "deleted\t%3d blocks" % (prev[1])
 
-for b, block in enumerate(split_by_n(img,128*1024)):
+for b, block in enumerate(split_by_n(img,CHUNK_SIZE*CHUNKS_PER_BLOCK)):
     print "[i] block", b
     prev = None
-    for c, raw in enumerate(split_by_n(block,128)):
+    for c, raw in enumerate(split_by_n(block,CHUNK_SIZE)):
         chunk=Chunk.parse(raw)
         if chunk.type == "Data":
             used[b]+=1
@@ -62,7 +62,8 @@ for b, block in enumerate(split_by_n(img,128*1024)):
                                                'oid': chunk.node.inode.oid,
                                                'type': chunk.node.inode.bits.type,
                                                'parent': chunk.node.inode.parent,
-                                               'size': chunk.node.inode.size,
+                                               'size': inode_size(chunk.node.inode),
+                                               'external': chunk.node.inode.bits.external,
                                                'name': name}
             else:
                 if 'parent' in objects[chunk.node.inode.oid]:
@@ -73,7 +74,8 @@ for b, block in enumerate(split_by_n(img,128*1024)):
                     name = chunk.node.inode.name[:nsize]
                     objects[chunk.node.inode.oid]['type']=chunk.node.inode.bits.type
                     objects[chunk.node.inode.oid]['parent']=chunk.node.inode.parent
-                    objects[chunk.node.inode.oid]['size']=chunk.node.inode.size
+                    objects[chunk.node.inode.oid]['size']=inode_size(chunk.node.inode)
+                    objects[chunk.node.inode.oid]['external']=chunk.node.inode.bits.external
                     objects[chunk.node.inode.oid]['name']=name
 
             if prev:
@@ -83,7 +85,7 @@ for b, block in enumerate(split_by_n(img,128*1024)):
                 "File" if (chunk.node.inode.bits.type==1) else "Directory",
                 name,
                 chunk.node.inode.oid,
-                chunk.node.inode.size,
+                inode_size(chunk.node.inode),
                 chunk.node.inode.parent)
             prev = None
         elif chunk.type == "Empty":
@@ -93,6 +95,9 @@ for b, block in enumerate(split_by_n(img,128*1024)):
             else:
                 if prev: dump_chunks(prev)
                 prev = ['e', 1]
+        elif chunk.type == "Header":
+            print "header\tv%d, erased %d times" % (chunk.node.header.version,
+                                                    chunk.node.header.erase_count)
         elif chunk.type == "Deleted":
             deleted[b]+=1
             if prev and prev[0]=='x':
@@ -109,7 +114,7 @@ for oid, obj in objects.items():
         if obj['oid']!=1:
             print "orphan\t%3d blocks (%dB) of %x [%s..%s]" % (
                 len(obj['seq']),
-                len(obj['seq'])*121,
+                len(obj['seq'])*DATA_PER_CHUNK,
                 obj['oid'],
                 str(obj['seq'][:3])[1:-1],
                 str(obj['seq'][-3:])[1:-1])
@@ -127,11 +132,13 @@ for oid, obj in objects.items():
     #    if i!=seq:
     #        print "missing chunk %d, from" % i, obj
     if obj['type']==1: # files
-        if (obj['size']/121)+1>len(obj['seq']) and obj['size']%121!=0:
-           print "[x] only %d chunks (%d B) for %d bytes - %s" % (len(obj['seq']), len(obj['seq'])*121, obj['size'], obj['path'])
+        if not obj['external']:
+            ls.append("%s %d (inline)" % (obj['path'], obj['size']))
+        elif (obj['size']/DATA_PER_CHUNK)+1>len(obj['seq']) and obj['size']%DATA_PER_CHUNK!=0:
+           print "[x] only %d chunks (%d B) for %d bytes - %s" % (len(obj['seq']), len(obj['seq'])*DATA_PER_CHUNK, obj['size'], obj['path'])
            print obj
         elif (obj['size']<len(obj['seq'])):
-           print "[i] %d chunks (%d B) for only %d bytes - %s" % (len(obj['seq']), len(obj['seq'])*121, obj['size'], obj['path'])
+           print "[i] %d chunks (%d B) for only %d bytes - %s" % (len(obj['seq']), len(obj['seq'])*DATA_PER_CHUNK, obj['size'], obj['path'])
         else:
             ls.append("%s %d" % (obj['path'], obj['size']))
     else: # directories
@@ -0,0 +1,104 @@
+/* flash backends for running stfs on a linux box */
+
+#include "backend.h"
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define IMAGE_SIZE(vol) ((vol)->nblocks*(vol)->chunks_per_block*(vol)->chunk_size)
+
+int stfs_mmap_open(STFS_Volume *vol, const char *path) {
+  const uint32_t image_size=IMAGE_SIZE(vol);
+  int fd=open(path, O_RDWR | O_CREAT, 0666);
+  if(fd<0) return -1;
+  off_t size=lseek(fd, 0, SEEK_END);
+  if(size<0) goto fail;
+  if(size!=0 && size!=image_size) {
+    // an image of another geometry, never overwrite it
+    errno=EINVAL;
+    goto fail;
+  }
+  if(size==0) {
+    // new image, start erased
+    uint8_t erased[4096];
+    uint32_t i, n;
+    memset(erased, 0xff, sizeof(erased));
+    for(i=0;i<image_size;i+=n) {
+      n=(image_size-i<sizeof(erased))?image_size-i:sizeof(erased);
+      if(pwrite(fd, erased, n, i)!=n) goto fail;
+    }
+  }
+  void *map=mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map==MAP_FAILED) return -1;
+  vol->flash=map;
+  return 0;
+ fail:
+  close(fd);
+  return -1;
+}
+
+int stfs_mmap_close(STFS_Volume *vol) {
+  if(msync(vol->flash, IMAGE_SIZE(vol), MS_SYNC)!=0) return -1;
+  return munmap(vol->flash, IMAGE_SIZE(vol));
+}
+
+// msync needs a page aligned start
+static void writeback(void *addr, uint32_t size) {
+  const uintptr_t page=sysconf(_SC_PAGESIZE);
+  const uintptr_t start=(uintptr_t) addr & ~(page-1);
+  msync((void*) start, (uintptr_t) addr+size-start, MS_ASYNC);
+}
+
+static int mmap_program(void *ctx, void *dst, const void *src, uint32_t size) {
+  memcpy(dst, src, size);
+  writeback(dst, size);
+  return 0;
+}
+
+static int mmap_erase(void *ctx, void *block, uint32_t size) {
+  memset(block, 0xff, size);
+  writeback(block, size);
+  return 0;
+}
+
+const STFS_Backend stfs_mmap_backend = { mmap_program, mmap_erase, NULL };
+
+static int nor_program(void *ctx, void *dst, const void *src, uint32_t size) {
+  STFS_NorSim *sim=ctx;
+  const uint8_t *d=dst, *s=src;
+  uint32_t i, changed=0;
+  for(i=0;i<size;i++) {
+    if((d[i] & s[i])!=s[i]) {
+      // nor flash can only clear bits
+      sim->violations++;
+      return -1;
+    }
+    if(d[i]!=s[i]) changed++;
+  }
+  memcpy(dst, src, size);
+  sim->programs++;
+  sim->programmed+=changed;
+  sim->busy_ns+=(uint64_t) changed*sim->program_ns;
+  return 0;
+}
+
+static int nor_erase(void *ctx, void *block, uint32_t size) {
+  STFS_NorSim *sim=ctx;
+  memset(block, 0xff, size);
+  sim->erases++;
+  sim->busy_ns+=sim->erase_ns;
+  return 0;
+}
+
+void stfs_nor_init(STFS_NorSim *sim, STFS_Backend *backend) {
+  memset(sim, 0, sizeof(*sim));
+  sim->program_ns=STFS_NOR_PROGRAM_NS;
+  sim->erase_ns=STFS_NOR_ERASE_NS;
+  backend->program=nor_program;
+  backend->erase=nor_erase;
+  backend->ctx=sim;
+}
@@ -0,0 +1,40 @@
+#ifndef STFS_BACKEND_H
+#define STFS_BACKEND_H
+
+#include "stfs.h"
+
+// maps the image at path as the flash of vol, whose geometry must be
+// set. the image is created erased if it does not exist or is empty,
+// an image of another size fails with errno EINVAL and is left as is.
+int stfs_mmap_open(STFS_Volume *vol, const char *path);
+int stfs_mmap_close(STFS_Volume *vol);
+
+// like the ram backend, but schedules every change to be written back
+// to the image
+extern const STFS_Backend stfs_mmap_backend;
+
+// default timing of the simulated nor flash, a 128KB sector of an
+// stm32f4: 16us per 32 bit word program, 1s sector erase
+#ifndef STFS_NOR_PROGRAM_NS
+#define STFS_NOR_PROGRAM_NS 4000 // per byte
+#endif
+#ifndef STFS_NOR_ERASE_NS
+#define STFS_NOR_ERASE_NS 1000000000ull // per block
+#endif
+
+// simulated nor flash on top of the ram backend. bytes that do not
+// change are skipped by programming, as a driver would. programs
+// trying to set bits are rejected and counted.
+typedef struct {
+  uint32_t program_ns;
+  uint64_t erase_ns;
+  uint64_t busy_ns;    // time the flash would have been busy
+  uint32_t programs;
+  uint32_t programmed; // bytes changed by programs
+  uint32_t erases;
+  uint32_t violations;
+} STFS_NorSim;
+
+void stfs_nor_init(STFS_NorSim *sim, STFS_Backend *backend);
+
+#endif // STFS_BACKEND_H
@@ -0,0 +1,162 @@
+#include "stfs.h"
+#include "backend.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// runs the same workload on simulated nor flash for every chunk size
+// and block count and reports the throughput, the write amplification
+// and the time to mount. all geometries run in one binary, it must be
+// built with CHUNK_SIZE and NBLOCKS large enough for the biggest one.
+//
+// usage: geobench
+//
+// blocks are BLOCK_SIZE bytes, the smaller the chunks the more of them
+// a block holds. the workload fills half of the volume with files
+// written sequentially in WRITE_SIZE pieces, reads them back, then
+// overwrites WRITE_SIZE pieces at random offsets until twice the
+// volume was written, and finally remounts.
+
+#define BLOCK_SIZE (128*1024)
+#define FILE_SIZE (96*1024) // larger than the 64KB of 16 bit sizes
+#define WRITE_SIZE 256
+
+static const uint32_t chunk_sizes[] = {128, 256, 512};
+static const uint32_t block_counts[] = {4, 16, 64};
+
+static uint8_t flash[NBLOCKS*BLOCK_SIZE];
+static STFS_Volume vol;
+static uint8_t data[FILE_SIZE];
+
+static uint32_t lcg(void) {
+  static uint32_t state=1;
+  state=state*1103515245+12345;
+  return state>>8;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static void path_of(uint32_t file, uint8_t path[16]) {
+  snprintf((char*) path, 16, "/f%d", file);
+}
+
+// writes len bytes of src at offset in pieces of WRITE_SIZE
+static int write_at(STFS_Volume *vol, uint32_t file, uint32_t offset,
+                    const uint8_t *src, uint32_t len, uint32_t oflag) {
+  uint8_t path[16];
+  uint32_t done;
+  path_of(file, path);
+  int fd=stfs_open(path, oflag, vol);
+  if(fd<0) return -1;
+  if(stfs_lseek(fd, offset, SEEK_SET, vol)!=offset) goto fail;
+  for(done=0;done<len;done+=WRITE_SIZE) {
+    const uint32_t n=(len-done<WRITE_SIZE)?len-done:WRITE_SIZE;
+    if(stfs_write(fd, src+done, n, vol)!=n) goto fail;
+  }
+  return stfs_close(fd, vol);
+ fail:
+  stfs_close(fd, vol);
+  return -1;
+}
+
+static int read_all(STFS_Volume *vol, uint32_t file) {
+  static uint8_t buf[FILE_SIZE];
+  uint8_t path[16];
+  path_of(file, path);
+  int fd=stfs_open(path, 0, vol);
+  if(fd<0) return -1;
+  const ssize_t ret=stfs_read(fd, buf, FILE_SIZE, vol);
+  stfs_close(fd, vol);
+  return (ret==FILE_SIZE && memcmp(buf, data, FILE_SIZE)==0)?0:-1;
+}
+
+// the time the cpu spent since start plus what the flash was busy
+static double elapsed(double start, const STFS_NorSim *nor, uint64_t busy) {
+  return now()-start+(nor->busy_ns-busy)/1e9;
+}
+
+static int run(uint32_t chunk_size, uint32_t nblocks) {
+  STFS_Backend backend;
+  STFS_NorSim nor;
+  STFS_MountInfo info;
+  uint32_t i, nfiles=(nblocks-1)*BLOCK_SIZE/FILE_SIZE/2;
+  uint64_t busy, written=0;
+  double start, t_write, t_read, t_over, t_mount;
+
+  memset(flash, 0xff, nblocks*BLOCK_SIZE);
+  vol.flash=flash;
+  vol.chunk_size=chunk_size;
+  vol.chunks_per_block=BLOCK_SIZE/chunk_size;
+  vol.nblocks=nblocks;
+  srandom(1);
+  stfs_nor_init(&nor, &backend);
+  if(stfs_mount(&vol, &backend, NULL)!=0) {
+    printf("[x] %dB x %d: mount failed, errno %d\n", chunk_size, nblocks, stfs_geterrno(&vol));
+    return -1;
+  }
+
+  start=now();
+  busy=nor.busy_ns;
+  for(i=0;i<nfiles;i++) {
+    if(write_at(&vol, i, 0, data, FILE_SIZE, O_CREAT)!=0) {
+      printf("[x] %dB x %d: failed to write file %d\n", chunk_size, nblocks, i);
+      return -1;
+    }
+  }
+  t_write=elapsed(start, &nor, busy);
+
+  start=now();
+  for(i=0;i<nfiles;i++) {
+    if(read_all(&vol, i)!=0) {
+      printf("[x] %dB x %d: failed to read file %d\n", chunk_size, nblocks, i);
+      return -1;
+    }
+  }
+  t_read=now()-start;
+
+  const uint32_t programs=nor.programs;
+  start=now();
+  busy=nor.busy_ns;
+  for(written=0;written<2ull*nblocks*BLOCK_SIZE;written+=WRITE_SIZE) {
+    // new content, else the chunks could be left as they are
+    uint8_t piece[WRITE_SIZE];
+    for(i=0;i<WRITE_SIZE;i++) piece[i]=lcg();
+    if(write_at(&vol, lcg()%nfiles, lcg()%(FILE_SIZE-WRITE_SIZE), piece, WRITE_SIZE, 0)!=0) {
+      printf("[x] %dB x %d: overwrite failed, errno %d\n", chunk_size, nblocks, stfs_geterrno(&vol));
+      return -1;
+    }
+  }
+  t_over=elapsed(start, &nor, busy);
+
+  start=now();
+  stfs_mount(&vol, &backend, &info);
+  t_mount=now()-start;
+
+  printf("%6d %6d %8d %10.1f %10.1f %10.1f %6.2f %7d %8.3f %8d\n",
+         chunk_size, nblocks, nblocks*BLOCK_SIZE/1024,
+         nfiles*FILE_SIZE/1024.0/t_write, nfiles*FILE_SIZE/1024.0/t_read,
+         written/1024.0/t_over, (double) (nor.programs-programs)*chunk_size/written,
+         nor.erases, t_mount*1000, info.chunks_visited);
+  return 0;
+}
+
+int main(void) {
+  uint32_t c, b;
+  memset(data, 0x5a, sizeof(data));
+  printf("block size %dKB, write size %dB\n", BLOCK_SIZE/1024, WRITE_SIZE);
+  printf("%6s %6s %8s %10s %10s %10s %6s %7s %8s %8s\n", "chunk", "blocks", "KB",
+         "write KB/s", "read KB/s", "over KB/s", "WA", "erases", "mount ms", "visited");
+  for(c=0;c<sizeof(chunk_sizes)/sizeof(chunk_sizes[0]);c++) {
+    for(b=0;b<sizeof(block_counts)/sizeof(block_counts[0]);b++) {
+      if(chunk_sizes[c]>CHUNK_SIZE || block_counts[b]>NBLOCKS ||
+         BLOCK_SIZE/chunk_sizes[c]>CHUNKS_PER_BLOCK) continue;
+      if(run(chunk_sizes[c], block_counts[b])!=0) return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,306 @@
+#include "stfs.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// times the core operations one by one on a RAM volume with the
+// largest geometry and reports per workload the operations per
+// second, the chunks scanned to locate inodes and data and the chunks
+// programmed per operation, and the median and 99th percentile
+// latency. the workloads are seeded, so runs of two builds can be
+// compared line by line.
+//
+// usage: microbench
+//
+//   seq write   writing 64KB files sequentially, per WRITE_SIZE write
+//   seq read    reading them back, per WRITE_SIZE read
+//   iov read    the same with stfs_read_iov, without copying
+//   overwrite   open, seek, write PIECE_SIZE at a random offset, close
+//   churn       creating a small file and unlinking the oldest one
+//   readdir     listing a directory of DIR_FILES files
+//   lookup      opening and closing files DEPTH directories deep, more
+//               of them than the path cache holds
+//   vacuum      on a fresh volume 3/4 full, rewriting the files per
+//               WRITE_SIZE write until twice the volume was written
+//
+// built with STFS_TRACE the last events of the vacuum workload are
+// dumped into microbench.trace, see stfstrace.py.
+
+#define FILE_SIZE (64*1024)
+#define SEQ_FILES 4
+#define WRITE_SIZE 256
+#define PIECE_SIZE 64
+#define SMALL_SIZE 100
+#define CHURN_FILES 16 // small files alive at once
+#define DIR_FILES 64
+#define DEPTH 8
+#define DEEP_FILES 32
+#define MAX_OPS 8192
+
+static Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK];
+static STFS_Volume vol=STFS_VOLUME(blocks);
+static uint8_t data[FILE_SIZE];
+static double lat[MAX_OPS];
+static uint32_t nops;
+static double op_start, run_start;
+
+static uint32_t lcg(void) {
+  static uint32_t state=1;
+  state=state*1103515245+12345;
+  return state>>8;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static void begin(void) {
+  nops=0;
+  stfs_stats_reset(&vol);
+  run_start=now();
+}
+
+static void op_begin(void) {
+  op_start=now();
+}
+
+static void op_end(void) {
+  if(nops<MAX_OPS) lat[nops]=now()-op_start;
+  nops++;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  const double x=*(const double*) a, y=*(const double*) b;
+  return (x>y)-(x<y);
+}
+
+static void report(const char *name) {
+  const double elapsed=now()-run_start;
+  const uint32_t n=(nops<MAX_OPS)?nops:MAX_OPS;
+  STFS_Stats stats;
+  stfs_stats(&vol, &stats);
+  qsort(lat, n, sizeof(lat[0]), cmp_double);
+  printf("%-10s %6d %10.0f %10.1f %11.2f %9.2f %9.2f\n", name, nops, nops/elapsed,
+         (double) stats.scanned/nops, (double) stats.programs/nops, lat[n/2]*1e6, lat[n*99/100]*1e6);
+}
+
+static int fail(const char *what) {
+  printf("[x] %s failed, errno %d\n", what, stfs_geterrno(&vol));
+  return 1;
+}
+
+static int mount_empty(void) {
+  memset(blocks, 0xff, sizeof(blocks));
+  srandom(1);
+  stfs_set_victim_policy(&vol, stfs_victim_deterministic);
+  return stfs_mount(&vol, NULL, NULL);
+}
+
+static void path_of(uint8_t *path, const char *dir, uint32_t i) {
+  snprintf((char*) path, 64, "%s/f%d", dir, i);
+}
+
+static int seq_write(void) {
+  uint8_t path[64];
+  uint32_t i, off;
+  begin();
+  for(i=0;i<SEQ_FILES;i++) {
+    path_of(path, "/seq", i);
+    const int fd=stfs_open(path, O_CREAT, &vol);
+    if(fd<0) return fail("seq create");
+    for(off=0;off<FILE_SIZE;off+=WRITE_SIZE) {
+      op_begin();
+      if(stfs_write(fd, data+off, WRITE_SIZE, &vol)!=WRITE_SIZE) return fail("seq write");
+      op_end();
+    }
+    if(stfs_close(fd, &vol)!=0) return fail("seq close");
+  }
+  report("seq write");
+  return 0;
+}
+
+static int seq_read(void) {
+  uint8_t path[64], buf[WRITE_SIZE];
+  uint32_t i, off;
+  begin();
+  for(i=0;i<SEQ_FILES;i++) {
+    path_of(path, "/seq", i);
+    const int fd=stfs_open(path, 0, &vol);
+    if(fd<0) return fail("seq open");
+    for(off=0;off<FILE_SIZE;off+=WRITE_SIZE) {
+      op_begin();
+      if(stfs_read(fd, buf, WRITE_SIZE, &vol)!=WRITE_SIZE) return fail("seq read");
+      op_end();
+      if(memcmp(buf, data+off, WRITE_SIZE)!=0) return fail("seq compare");
+    }
+    stfs_close(fd, &vol);
+  }
+  report("seq read");
+  return 0;
+}
+
+static int iov_read(void) {
+  uint8_t path[64];
+  STFS_Segment segs[WRITE_SIZE/DATA_PER_CHUNK+2];
+  uint32_t i, j, off, pos, nsegs;
+  begin();
+  for(i=0;i<SEQ_FILES;i++) {
+    path_of(path, "/seq", i);
+    const int fd=stfs_open(path, 0, &vol);
+    if(fd<0) return fail("iov open");
+    for(off=0;off<FILE_SIZE;off+=WRITE_SIZE) {
+      nsegs=sizeof(segs)/sizeof(segs[0]);
+      op_begin();
+      if(stfs_read_iov(fd, segs, &nsegs, WRITE_SIZE, &vol)!=WRITE_SIZE) return fail("iov read");
+      op_end();
+      for(j=0,pos=off;j<nsegs;pos+=segs[j++].len) {
+        if(memcmp(segs[j].data, data+pos, segs[j].len)!=0) return fail("iov compare");
+      }
+    }
+    stfs_close(fd, &vol);
+  }
+  report("iov read");
+  return 0;
+}
+
+static int overwrite(void) {
+  uint8_t path[64], piece[PIECE_SIZE];
+  uint32_t i, j;
+  begin();
+  for(i=0;i<2000;i++) {
+    // new content, else the chunks could be left as they are
+    for(j=0;j<PIECE_SIZE;j++) piece[j]=lcg();
+    path_of(path, "/seq", lcg()%SEQ_FILES);
+    const uint32_t off=lcg()%(FILE_SIZE-PIECE_SIZE);
+    op_begin();
+    const int fd=stfs_open(path, 0, &vol);
+    if(fd<0 || stfs_lseek(fd, off, SEEK_SET, &vol)!=off ||
+       stfs_write(fd, piece, PIECE_SIZE, &vol)!=PIECE_SIZE || stfs_close(fd, &vol)!=0) {
+      return fail("overwrite");
+    }
+    op_end();
+  }
+  report("overwrite");
+  return 0;
+}
+
+static int churn(void) {
+  uint8_t path[64];
+  uint32_t i;
+  begin();
+  for(i=0;i<2000+CHURN_FILES;i++) {
+    path_of(path, "/churn", i);
+    if(i>=CHURN_FILES) op_begin();
+    const int fd=stfs_open(path, O_CREAT, &vol);
+    if(fd<0 || stfs_write(fd, data, SMALL_SIZE, &vol)!=SMALL_SIZE || stfs_close(fd, &vol)!=0) {
+      return fail("churn create");
+    }
+    if(i<CHURN_FILES) continue;
+    path_of(path, "/churn", i-CHURN_FILES);
+    if(stfs_unlink(&vol, path)!=0) return fail("churn unlink");
+    op_end();
+  }
+  report("churn");
+  return 0;
+}
+
+static int list_dir(void) {
+  uint8_t path[64], dir[]="/dir";
+  uint32_t i, n;
+  ReaddirCTX ctx;
+  for(i=0;i<DIR_FILES;i++) {
+    path_of(path, "/dir", i);
+    const int fd=stfs_open(path, O_CREAT, &vol);
+    if(fd<0 || stfs_close(fd, &vol)!=0) return fail("readdir create");
+  }
+  begin();
+  for(i=0;i<500;i++) {
+    op_begin();
+    if(opendir(&vol, dir, &ctx)!=0) return fail("opendir");
+    for(n=0;readdir(&vol, &ctx)!=NULL;n++);
+    op_end();
+    if(n!=DIR_FILES) return fail("readdir");
+  }
+  report("readdir");
+  return 0;
+}
+
+static int lookup(void) {
+  uint8_t path[64], dir[64]="";
+  uint32_t i;
+  for(i=0;i<DEPTH;i++) {
+    snprintf((char*) dir+strlen((char*) dir), sizeof(dir)-strlen((char*) dir), "/%c", 'a'+i);
+    if(stfs_mkdir(&vol, dir)!=0) return fail("lookup mkdir");
+  }
+  for(i=0;i<DEEP_FILES;i++) {
+    path_of(path, (char*) dir, i);
+    const int fd=stfs_open(path, O_CREAT, &vol);
+    if(fd<0 || stfs_close(fd, &vol)!=0) return fail("lookup create");
+  }
+  begin();
+  for(i=0;i<4000;i++) {
+    path_of(path, (char*) dir, i%DEEP_FILES);
+    op_begin();
+    const int fd=stfs_open(path, 0, &vol);
+    if(fd<0 || stfs_close(fd, &vol)!=0) return fail("lookup");
+    op_end();
+  }
+  report("lookup");
+  return 0;
+}
+
+static int vacuum(void) {
+  const uint32_t volume=NBLOCKS*CHUNKS_PER_BLOCK*DATA_PER_CHUNK;
+  const uint32_t nfiles=(volume-volume/NBLOCKS)*3/4/FILE_SIZE;
+  uint8_t path[64];
+  uint32_t i, off, written;
+  if(mount_empty()!=0) return fail("vacuum mount");
+  for(i=0;i<nfiles;i++) {
+    path_of(path, "", i);
+    const int fd=stfs_open(path, O_CREAT, &vol);
+    if(fd<0 || stfs_write(fd, data, FILE_SIZE, &vol)!=FILE_SIZE || stfs_close(fd, &vol)!=0) {
+      return fail("vacuum fill");
+    }
+  }
+  begin();
+  for(written=0,i=0;written<2*volume;i++) {
+    path_of(path, "", i%nfiles);
+    const int fd=stfs_open(path, 0, &vol);
+    if(fd<0) return fail("vacuum open");
+    for(off=0;off<FILE_SIZE;off+=WRITE_SIZE,written+=WRITE_SIZE) {
+      // flip the content, else the chunks could be left as they are
+      data[off]^=0xff;
+      op_begin();
+      if(stfs_write(fd, data+off, WRITE_SIZE, &vol)!=WRITE_SIZE) return fail("vacuum write");
+      op_end();
+    }
+    if(stfs_close(fd, &vol)!=0) return fail("vacuum close");
+  }
+  report("vacuum");
+#ifdef STFS_TRACE
+  static STFS_TraceEvent events[STFS_TRACE_EVENTS];
+  const uint32_t n=stfs_trace(&vol, events, STFS_TRACE_EVENTS);
+  FILE *dump=fopen("microbench.trace", "wb");
+  if(dump==NULL || fwrite(events, sizeof(events[0]), n, dump)!=n) return fail("trace dump");
+  fclose(dump);
+#endif // STFS_TRACE
+  return 0;
+}
+
+int main(void) {
+  uint32_t i;
+  for(i=0;i<FILE_SIZE;i++) data[i]=i*7;
+  uint8_t seq[]="/seq", dir[]="/dir", churn_dir[]="/churn";
+  if(mount_empty()!=0 || stfs_mkdir(&vol, seq)!=0 || stfs_mkdir(&vol, dir)!=0 ||
+     stfs_mkdir(&vol, churn_dir)!=0) {
+    return fail("setup");
+  }
+  printf("%dB chunks, %d chunks per block, %d blocks\n", CHUNK_SIZE, CHUNKS_PER_BLOCK, NBLOCKS);
+  printf("%-10s %6s %10s %10s %11s %9s %9s\n", "workload", "ops", "ops/s", "scanned/op", "programs/op",
+         "p50 us", "p99 us");
+  if(seq_write() || seq_read() || iov_read() || overwrite() || churn() || list_dir() || lookup() || vacuum()) return 1;
+  return 0;
+}
@@ -0,0 +1,196 @@
+#include "stfs.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+// measures how reading scales with the number of threads on one
+// volume, it must be built with STFS_THREADS. every reader has its own
+// descriptor on one of NFILES configuration files and rereads it from
+// the start in READ_SIZE pieces for DURATION seconds. each thread
+// count runs twice, the second time while a writer appends
+// WRITE_SIZE records to a log file, and once more with readers that
+// take a snapshot of their file for every pass instead, alongside the
+// writer.
+//
+// usage: mtbench [max threads]
+
+#ifndef STFS_THREADS
+#error "mtbench needs STFS_THREADS"
+#endif
+
+#define NFILES 4
+#define FILE_SIZE 4096
+#define READ_SIZE 256
+#define WRITE_SIZE 64
+#define LOG_SIZE (64*1024) // the log starts over once it is this large
+#define DURATION 0.5
+#define MAX_THREADS (MAX_OPEN_FILES-1)
+
+static Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK];
+static STFS_Volume vol=STFS_VOLUME(blocks);
+static uint8_t config[FILE_SIZE];
+static int stop;
+
+typedef struct {
+  pthread_t thread;
+  uint32_t file;
+  uint64_t bytes;
+  int failed;
+  int err; // errno is kept per thread
+} Worker;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static void path_of(uint32_t file, uint8_t path[16]) {
+  snprintf((char*) path, 16, "/etc/c%d", file);
+}
+
+static void* reader(void *arg) {
+  Worker *w=arg;
+  uint8_t path[16], buf[READ_SIZE];
+  uint32_t off;
+  path_of(w->file, path);
+  int fd=stfs_open(path, 0, &vol);
+  if(fd<0) {
+    w->failed=1;
+    w->err=stfs_geterrno(&vol);
+    return NULL;
+  }
+  while(!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+    stfs_lseek(fd, 0, SEEK_SET, &vol);
+    for(off=0;off<FILE_SIZE;off+=READ_SIZE) {
+      if(stfs_read(fd, buf, READ_SIZE, &vol)!=READ_SIZE ||
+         memcmp(buf, config+off, READ_SIZE)!=0) {
+        w->failed=1;
+        w->err=stfs_geterrno(&vol);
+        break;
+      }
+      w->bytes+=READ_SIZE;
+    }
+  }
+  stfs_close(fd, &vol);
+  return NULL;
+}
+
+// like reader, but reads a snapshot without taking the volume lock
+static void* snapshot_reader(void *arg) {
+  Worker *w=arg;
+  uint8_t path[16], buf[READ_SIZE];
+  STFS_ChunkRef refs[FILE_SIZE/DATA_PER_CHUNK+1];
+  STFS_Snapshot snap;
+  uint32_t off;
+  path_of(w->file, path);
+  while(!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+    if(stfs_snapshot(&vol, path, &snap, refs, sizeof(refs)/sizeof(refs[0]))!=0) {
+      w->failed=1;
+      w->err=stfs_geterrno(&vol);
+      break;
+    }
+    for(off=0;off<FILE_SIZE;off+=READ_SIZE) {
+      if(stfs_snapshot_read(&snap, off, buf, READ_SIZE)!=READ_SIZE ||
+         memcmp(buf, config+off, READ_SIZE)!=0) {
+        w->failed=1;
+        w->err=stfs_geterrno(&vol);
+        break;
+      }
+      w->bytes+=READ_SIZE;
+    }
+    stfs_snapshot_release(&snap);
+  }
+  return NULL;
+}
+
+static void* writer(void *arg) {
+  Worker *w=arg;
+  uint8_t path[]="/log", record[WRITE_SIZE];
+  memset(record, 'l', sizeof(record));
+  while(!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+    int fd=stfs_open(path, 0, &vol);
+    if(fd<0) fd=stfs_open(path, O_CREAT, &vol);
+    if(fd<0 || stfs_lseek(fd, 0, SEEK_END, &vol)<0 ||
+       stfs_write(fd, record, WRITE_SIZE, &vol)!=WRITE_SIZE) {
+      w->failed=1;
+      w->err=stfs_geterrno(&vol);
+      break;
+    }
+    const uint32_t size=stfs_size(fd, &vol);
+    stfs_close(fd, &vol);
+    if(size>=LOG_SIZE) stfs_truncate(path, 0, &vol);
+    w->bytes+=WRITE_SIZE;
+  }
+  return NULL;
+}
+
+// runs nthreads readers, and the writer if with_writer, for DURATION
+static int run(uint32_t nthreads, int with_writer, int snapshots, double *read_kbs, double *writes) {
+  Worker workers[MAX_THREADS+1];
+  uint32_t i, n=nthreads+(with_writer?1:0);
+  uint64_t bytes=0;
+  memset(workers, 0, sizeof(workers));
+  __atomic_store_n(&stop, 0, __ATOMIC_RELAXED);
+  const double start=now();
+  for(i=0;i<n;i++) {
+    workers[i].file=i%NFILES;
+    pthread_create(&workers[i].thread, NULL, (i>=nthreads)?writer:snapshots?snapshot_reader:reader,
+                   &workers[i]);
+  }
+  while(now()-start<DURATION) {
+    struct timespec ts={0, 10000000};
+    nanosleep(&ts, NULL);
+  }
+  __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+  for(i=0;i<n;i++) pthread_join(workers[i].thread, NULL);
+  const double elapsed=now()-start;
+  for(i=0;i<n;i++) {
+    if(workers[i].failed) {
+      printf("[x] %s %d failed, errno %d\n", (i<nthreads)?"reader":"writer", i, workers[i].err);
+      return -1;
+    }
+    if(i<nthreads) bytes+=workers[i].bytes;
+  }
+  *read_kbs=bytes/1024.0/elapsed;
+  *writes=with_writer?workers[nthreads].bytes/WRITE_SIZE/elapsed:0;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  uint32_t i, nthreads, max_threads=(argc>1)?atoi(argv[1]):8;
+  uint8_t dir[]="/etc", path[16];
+  double base=0;
+  if(max_threads<1 || max_threads>MAX_THREADS) max_threads=MAX_THREADS;
+
+  memset(blocks, 0xff, sizeof(blocks));
+  if(stfs_mount(&vol, NULL, NULL)!=0 || stfs_mkdir(&vol, dir)!=0) {
+    printf("[x] setup failed, errno %d\n", stfs_geterrno(&vol));
+    return 1;
+  }
+  for(i=0;i<FILE_SIZE;i++) config[i]=i*7;
+  for(i=0;i<NFILES;i++) {
+    path_of(i, path);
+    int fd=stfs_open(path, O_CREAT, &vol);
+    if(fd<0 || stfs_write(fd, config, FILE_SIZE, &vol)!=FILE_SIZE || stfs_close(fd, &vol)!=0) {
+      printf("[x] failed to write %s, errno %d\n", path, stfs_geterrno(&vol));
+      return 1;
+    }
+  }
+
+  printf("%ld cpus online, %d files of %dB read in %dB pieces\n",
+         sysconf(_SC_NPROCESSORS_ONLN), NFILES, FILE_SIZE, READ_SIZE);
+  printf("%7s %12s %8s %14s %10s %14s %10s\n", "readers", "read KB/s", "speedup", "+writer KB/s", "writes/s",
+         "snapshot KB/s", "writes/s");
+  for(nthreads=1;nthreads<=max_threads;nthreads*=2) {
+    double alone, shared, writes, snapshot, snapshot_writes, unused;
+    if(run(nthreads, 0, 0, &alone, &unused)!=0 || run(nthreads, 1, 0, &shared, &writes)!=0 ||
+       run(nthreads, 1, 1, &snapshot, &snapshot_writes)!=0) return 1;
+    if(nthreads==1) base=alone;
+    printf("%7d %12.0f %8.2f %14.0f %10.0f %14.0f %10.0f\n", nthreads, alone, alone/base, shared, writes,
+           snapshot, snapshot_writes);
+  }
+  return 0;
+}
@@ -15,43 +15,53 @@
 
   - no file metadata like timestamps or access permissions.
 
-  - filenames are max 32 bytes long, files max 64KB.
+  - filenames are max 32 bytes long, files max MAX_FILE_SIZE (2GB).
 
   - always reserves one empty block for vacuuming.
 
   - default blocksize is 128B with fs metadata included. unlike other
     flash filesystems where the blocksize is usually limited by 512B.
 
-  - single threaded
+  - single threaded per volume unless built with STFS_THREADS
 
    data structure
 
    chunk_size = 128
    chunks_per_block = 1024
 
-   4 different chunk types are used:
+   5 different chunk types are used:
 
    empty = 0xff (1B) irrelevant(all 0xff) (127B)
    inode (128B)- contain file meta information
      - chunktype (0xAA) (1B)
      - directory | file (1b)
-     - size (2B)
+     - size (4B)
      - parent_directory_obj_id (4B)
      - obj_id (4B)
      - name_len (6b)
+     - external (1b) - 0 if the file content is inline in data
      - name (32B)
-     - data (84B)
-   data (7B) - contain data
+     - data (82B) - content of files up to 82B, otherwise a journal
+       of sizes (4B each), the last one programmed is the file size
+   data (9B) - contain data
     - chunktype (0xCC) (1B)
-    - seq_id (2B)
+    - seq_id (4B)
     - obj_id (4B)
     - data blob (chunksize-metasize)
    deleted = 0x00 (1B) irrelevant(all 0x00) (127B)
+   header (10B) - first chunk of every block in use
+    - chunktype (0x55) (1B)
+    - magic "STFS" (4B)
+    - version (1B) - 2, mount fails with E_FORMAT on others
+    - erase count (4B)
 
    inode with oid 1 is the root directory and virtual
 
  */
 
+#if defined(STFS_THREADS) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // pthread_rwlockattr_setkind_np
+#endif
 #include <stdint.h>
 #include <string.h> // mem*
 #include <stdio.h>  // printf
@@ -61,10 +71,9 @@
 
 #include "stfs.h"
 
-#define OID_BLOCK_SIZE (CHUNKS_PER_BLOCK * (NBLOCKS - 1) + MAX_OPEN_FILES + 3)
-#define OID_START_OFFSET 1
+#define OID_FIRST 2 // oid 1 is the root directory
 
-#define VALIDFD(fd) if(validfd(fd)!=0) return -1;
+#define VALIDFD(vol,fd) if(validfd(vol,fd)!=0) return -1;
 
 #ifdef DEBUG_LEVEL
 #define LOG(level, ...) if(DEBUG_LEVEL>=level) fprintf(stderr, ##__VA_ARGS__)
@@ -72,10 +81,124 @@
 #define LOG(level, ...)
 #endif // DEBUG_LEVEL
 
-static STFS_File fdesc[MAX_OPEN_FILES];
-static uint32_t errno;
-static uint32_t reserved_block;
-static uint32_t current_oid_offset = OID_START_OFFSET;
+// chunk c of block b, chunks are stored chunk_size apart
+#define CHUNK(vol,b,c) ((Chunk*) ((vol)->flash+((b)*(vol)->chunks_per_block+(c))*(vol)->chunk_size))
+#define CHUNK_REF(vol,b,c) ((b)*(vol)->chunks_per_block+(c))
+#define CHUNK_AT(vol,ref) ((const Chunk*) ((vol)->flash+(ref)*(vol)->chunk_size))
+#define NO_CHUNK ((STFS_ChunkRef) 0xffffffff)
+
+#ifdef STFS_THREADS
+#define READ_LOCK(vol) pthread_rwlock_rdlock(&(vol)->lock)
+#define WRITE_LOCK(vol) pthread_rwlock_wrlock(&(vol)->lock)
+#define UNLOCK(vol) pthread_rwlock_unlock(&(vol)->lock)
+#define CACHE_LOCK(vol) pthread_mutex_lock(&(vol)->cache_lock)
+#define CACHE_UNLOCK(vol) pthread_mutex_unlock(&(vol)->cache_lock)
+// readers fail in parallel, so every thread keeps its own last error
+static __thread uint32_t thread_err;
+#define ERR(vol) thread_err
+// readers move the hint in parallel, it is only ever a guess anyway
+#define LOAD_HINT(vol) __atomic_load_n(&(vol)->data_hint, __ATOMIC_RELAXED)
+#define STORE_HINT(vol,ref) __atomic_store_n(&(vol)->data_hint, (ref), __ATOMIC_RELAXED)
+// snapshots are taken alongside other readers and released without
+// any lock, the writer sees a release only after the last read
+#define PINNED(vol,b) (__atomic_load_n(&(vol)->pins[b], __ATOMIC_ACQUIRE)!=0)
+#define PIN(vol,b) __atomic_add_fetch(&(vol)->pins[b], 1, __ATOMIC_RELAXED)
+#define UNPIN(vol,b) __atomic_sub_fetch(&(vol)->pins[b], 1, __ATOMIC_RELEASE)
+#define COUNT(vol,counter,n) __atomic_add_fetch(&(vol)->stats.counter, (n), __ATOMIC_RELAXED)
+// segments are used without any lock, their owners check the
+// generation afterwards
+#define NEW_GENERATION(vol) __atomic_add_fetch(&(vol)->generation, 1, __ATOMIC_RELEASE)
+#define GENERATION(vol) __atomic_load_n(&(vol)->generation, __ATOMIC_ACQUIRE)
+#else
+#define READ_LOCK(vol) do {} while(0)
+#define WRITE_LOCK(vol) do {} while(0)
+#define UNLOCK(vol) do {} while(0)
+#define CACHE_LOCK(vol) do {} while(0)
+#define CACHE_UNLOCK(vol) do {} while(0)
+#define ERR(vol) ((vol)->err)
+#define LOAD_HINT(vol) ((vol)->data_hint)
+#define STORE_HINT(vol,ref) ((vol)->data_hint=(ref))
+#define PINNED(vol,b) ((vol)->pins[b]!=0)
+#define PIN(vol,b) ((vol)->pins[b]++)
+#define UNPIN(vol,b) ((vol)->pins[b]--)
+#define COUNT(vol,counter,n) ((vol)->stats.counter+=(n))
+#define NEW_GENERATION(vol) ((vol)->generation++)
+#define GENERATION(vol) ((vol)->generation)
+#endif // STFS_THREADS
+
+#if STFS_STATS == 0
+#undef COUNT
+#define COUNT(vol,counter,n) ((void) (n))
+#endif // STFS_STATS
+
+#ifdef STFS_TRACE
+#if (STFS_TRACE_EVENTS & (STFS_TRACE_EVENTS-1)) != 0
+#error "STFS_TRACE_EVENTS must be a power of 2"
+#endif
+#ifndef STFS_TRACE_CLOCK
+#include <time.h>
+static uint32_t trace_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000u+ts.tv_nsec;
+}
+#define STFS_TRACE_CLOCK() trace_clock()
+#endif // STFS_TRACE_CLOCK
+
+#ifdef STFS_THREADS
+static uint16_t trace_threads;
+static __thread uint16_t trace_thread;
+// readers that lap the ring can land on the same slot, such an event
+// may come out mixed but the stores don't race
+#define TRACE_SET(field,v) __atomic_store_n(&(field), (v), __ATOMIC_RELAXED)
+#else
+#define TRACE_SET(field,v) ((field)=(v))
+#endif
+
+// readers record in parallel, each claims its own slot
+static void trace(STFS_Volume *vol, uint8_t type, uint8_t op, uint32_t arg0, uint32_t arg1) {
+  // the clock is read right before the slot is claimed, still threads
+  // can claim their slots in another order than they read the clock
+  const uint32_t time=STFS_TRACE_CLOCK();
+#ifdef STFS_THREADS
+  if(trace_thread==0) trace_thread=__atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+  const uint32_t n=__atomic_fetch_add(&vol->trace_next, 1, __ATOMIC_RELAXED);
+  const uint16_t thread=trace_thread;
+#else
+  const uint32_t n=vol->trace_next++;
+  const uint16_t thread=0;
+#endif
+  STFS_TraceEvent *event=&vol->trace[n&(STFS_TRACE_EVENTS-1)];
+  TRACE_SET(event->time, time);
+  TRACE_SET(event->type, type);
+  TRACE_SET(event->op, op);
+  TRACE_SET(event->thread, thread);
+  TRACE_SET(event->arg[0], arg0);
+  TRACE_SET(event->arg[1], arg1);
+}
+#define TRACE(vol,type,arg0,arg1) trace(vol, STFS_TRACE_##type, 0, arg0, arg1)
+#define TRACE_BEGIN(vol,op,arg0,arg1) trace(vol, STFS_TRACE_BEGIN, STFS_OP_##op, arg0, arg1)
+#define TRACE_END(vol,op,ret) trace(vol, STFS_TRACE_END, STFS_OP_##op, ret, ERR(vol))
+#else
+#define TRACE(vol,type,arg0,arg1) do {} while(0)
+#define TRACE_BEGIN(vol,op,arg0,arg1) do {} while(0)
+#define TRACE_END(vol,op,ret) do {} while(0)
+#endif // STFS_TRACE
+
+#if STFS_SNAPSHOTS == 0
+// nothing reads chunks behind the back of the writer
+#undef PINNED
+#define PINNED(vol,b) 0
+#endif // STFS_SNAPSHOTS
+
+// chunks are separated by their expected lifetime: inodes are
+// rewritten on every close that changed the file, overwritten data is
+// likely to be overwritten again, appended data likely stays. with
+// fewer streams the higher ones share the last stream.
+#define STREAM_META 0
+#define STREAM_HOT  1
+#define STREAM_COLD 2
+#define STREAM(s) (((s)<STFS_STREAMS)?(s):STFS_STREAMS-1)
 
 void dump(uint8_t *src, uint32_t len) {
   uint32_t i,j;
@@ -114,6 +237,10 @@ void dump_chunk(Chunk *chunk) {
   switch(chunk->type) {
   case(Empty): { printf("[i] chunk: empty\n"); break; }
   case(Deleted): { printf("[i] chunk: deleted\n"); break; }
+  case(Header): {
+    printf("[i] chunk: header v%d, erased %d times\n", chunk->header.version, chunk->header.erase_count);
+    break;
+  }
   case(Data): {
     printf("[i] chunk: data %d %d\n", chunk->data.oid, chunk->data.seq);
     dump(chunk->data.data,DATA_PER_CHUNK);
@@ -126,91 +253,301 @@ void dump_chunk(Chunk *chunk) {
   }
 }
 
-static int validfd(uint32_t fildes) {
+static int validfd(STFS_Volume *vol, uint32_t fildes) {
   if(fildes>=MAX_OPEN_FILES) {
     // fail invalid fildes
     LOG(1, "[x] invalid fd, %d\n", fildes);
-    errno = E_INVFD;
+    ERR(vol) = E_INVFD;
     return -1;
   }
-  if(fdesc[fildes].free!=0) {
+  if(vol->fdesc[fildes].free!=0) {
     // fail not open
     LOG(1, "[x] unused fd, %d\n", fildes);
-    errno = E_NOTOPEN;
+    ERR(vol) = E_NOTOPEN;
     return -1;
   }
   return 0;
 }
 
-static const Chunk* find_inode_by_parent_fname(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK],
+#ifdef STFS_INDEX
+#if (STFS_INDEX_BUCKETS & (STFS_INDEX_BUCKETS-1)) != 0
+#error "STFS_INDEX_BUCKETS must be a power of 2"
+#endif
+#if (STFS_DENTRY_BUCKETS & (STFS_DENTRY_BUCKETS-1)) != 0
+#error "STFS_DENTRY_BUCKETS must be a power of 2"
+#endif
+
+static uint32_t data_hash(const uint32_t oid, const uint32_t seq) {
+  return ((oid * 2654435761u) ^ (seq * 40503u)) & (STFS_INDEX_BUCKETS-1);
+}
+
+static uint32_t dentry_hash(const uint32_t parent, const uint8_t *name, const uint32_t len) {
+  uint32_t i, h=2166136261u ^ parent;
+  for(i=0;i<len;i++) {
+    h=(h ^ name[i]) * 16777619u;
+  }
+  return h & (STFS_DENTRY_BUCKETS-1);
+}
+
+static STFS_ChunkRef* index_bucket(STFS_Volume *vol, const Chunk *chunk) {
+  if(chunk->type==Data) {
+    return &vol->data_head[data_hash(chunk->data.oid, chunk->data.seq)];
+  }
+  if(chunk->type==Inode) {
+    return &vol->dentry_head[dentry_hash(chunk->inode.parent, chunk->inode.name, chunk->inode.name_len)];
+  }
+  return NULL;
+}
+
+static void index_add(STFS_Volume *vol, const uint32_t b, const uint32_t c) {
+  STFS_ChunkRef *head=index_bucket(vol, CHUNK(vol,b,c));
+  if(head==NULL) return;
+  vol->chunk_next[CHUNK_REF(vol,b,c)]=*head;
+  *head=CHUNK_REF(vol,b,c);
+}
+
+// must be called before the chunk is overwritten, as the key is read from it
+static void index_del(STFS_Volume *vol, const uint32_t b, const uint32_t c) {
+  STFS_ChunkRef *ref=index_bucket(vol, CHUNK(vol,b,c));
+  if(ref==NULL) return;
+  while(*ref!=NO_CHUNK) {
+    if(*ref==CHUNK_REF(vol,b,c)) {
+      *ref=vol->chunk_next[*ref];
+      return;
+    }
+    ref=&vol->chunk_next[*ref];
+  }
+  LOG(1, "[x] chunk %d %d missing from index\n", b, c);
+}
+
+static void index_clear(STFS_Volume *vol) {
+  memset(vol->data_head,0xff,sizeof(vol->data_head));
+  memset(vol->dentry_head,0xff,sizeof(vol->dentry_head));
+}
+#endif // STFS_INDEX
+
+static const Chunk* find_inode_by_parent_fname(STFS_Volume *vol,
                          const uint32_t parent,
                          const uint8_t* fname,
                          uint32_t *block, uint32_t *chunk) {
   LOG(3, "[i] find_inode_by_parent_fname %x %s %d %d\n", parent, fname, *block, *chunk);
-  uint32_t b;
   const uint32_t fsize=strlen((const char*) fname);
-  for(b=0;b<NBLOCKS;b++) {
-    if(b==reserved_block) continue;
+  uint32_t scanned=0;
+#ifdef STFS_INDEX
+  STFS_ChunkRef ref;
+  for(ref=vol->dentry_head[dentry_hash(parent, fname, fsize)];ref!=NO_CHUNK;ref=vol->chunk_next[ref]) {
+    const Chunk *found=CHUNK(vol,0,ref);
+    scanned++;
+    if(found->inode.parent==parent &&
+       fsize == found->inode.name_len &&
+       memcmp(fname, found->inode.name, fsize)==0) {
+      *block=ref/vol->chunks_per_block;
+      *chunk=ref%vol->chunks_per_block;
+      COUNT(vol, scanned, scanned);
+      return found;
+    }
+  }
+  COUNT(vol, scanned, scanned);
+  return NULL;
+#else
+  uint32_t b;
+  for(b=0;b<vol->nblocks;b++) {
+    if(b==vol->reserved_block || vol->live_chunks[b]==0 || vol->inode_oid_min[b]>vol->inode_oid_max[b]) continue;
     uint32_t c;
-    for(c=0;c<CHUNKS_PER_BLOCK && blocks[b][c].type!=Empty;c++) {
-      //fprintf(stderr, "[O] %d == %d '%s', '%s'\n", fsize, blocks[b][c].inode.name_len, fname, blocks[b][c].inode.name);
-      if(blocks[b][c].type==Inode &&
-         (blocks[b][c].inode.parent==parent) &&
-         (fsize == blocks[b][c].inode.name_len) &&
-         memcmp(fname, &blocks[b][c].inode.name, blocks[b][c].inode.name_len)==0) {
+    for(c=0;c<vol->chunks_per_block && CHUNK(vol,b,c)->type!=Empty;c++) {
+      scanned++;
+      //fprintf(stderr, "[O] %d == %d '%s', '%s'\n", fsize, CHUNK(vol,b,c)->inode.name_len, fname, CHUNK(vol,b,c)->inode.name);
+      if(CHUNK(vol,b,c)->type==Inode &&
+         (CHUNK(vol,b,c)->inode.parent==parent) &&
+         (fsize == CHUNK(vol,b,c)->inode.name_len) &&
+         memcmp(fname, CHUNK(vol,b,c)->inode.name, CHUNK(vol,b,c)->inode.name_len)==0) {
          *block=b;
          *chunk=c;
-         //printf("asdf %x %s --- %s\n", &blocks[b][c], fname, blocks[b][c].inode.name);
-         //dump_chunk(&blocks[b][c]);
-         return &blocks[b][c];
+         //printf("asdf %x %s --- %s\n", CHUNK(vol,b,c), fname, CHUNK(vol,b,c)->inode.name);
+         //dump_chunk(CHUNK(vol,b,c));
+         COUNT(vol, scanned, scanned);
+         return CHUNK(vol,b,c);
          }
     }
   }
+  COUNT(vol, scanned, scanned);
   return NULL;
+#endif // STFS_INDEX
 }
 
-static const Chunk* find_chunk(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK],
+// matches any seq in find_chunk()
+#define ANY_SEQ 0xffffffff
+
+static const Chunk* find_chunk(STFS_Volume *vol,
                          const ChunkType type,
                          const uint32_t oid,
                          const uint32_t parent,
-                         const uint16_t seq,
+                         const uint32_t seq,
                          uint32_t *block, uint32_t *chunk) {
   //printf("[i] find_chunk %x %x %x %x %d %d\n", type, oid, parent, seq, *block, *chunk);
-  uint32_t b,c=*chunk;
-  for(b=*block;b<NBLOCKS;b++) {
-    if(b==reserved_block) continue;
-    for(;c<CHUNKS_PER_BLOCK;c++) {
-      if(blocks[b][c].type==type && (
+  uint32_t b,c=*chunk, scanned=0;
+  for(b=*block;b<vol->nblocks;b++,c=0) {
+    if(b==vol->reserved_block) continue;
+    if(type==Data && (oid<vol->data_oid_min[b] || oid>vol->data_oid_max[b])) continue;
+    if(type==Inode && (vol->inode_oid_min[b]>vol->inode_oid_max[b] ||
+                       (oid!=0 && (oid<vol->inode_oid_min[b] || oid>vol->inode_oid_max[b])))) continue;
+    for(;c<vol->chunks_per_block;c++) {
+      scanned++;
+      if(CHUNK(vol,b,c)->type==type && (
               // for inodes we match oids
-              (type==Inode && oid!=0 && blocks[b][c].inode.oid==oid) ||
+              (type==Inode && oid!=0 && CHUNK(vol,b,c)->inode.oid==oid) ||
               // for inodes we match or parents
-              (type==Inode && parent!=0 && blocks[b][c].inode.parent==parent) ||
+              (type==Inode && parent!=0 && CHUNK(vol,b,c)->inode.parent==parent) ||
               // for data we match oid and seq
-              (type==Data && seq!=0xffff && blocks[b][c].data.oid==oid && blocks[b][c].data.seq==seq) ||
+              (type==Data && seq!=ANY_SEQ && CHUNK(vol,b,c)->data.oid==oid && CHUNK(vol,b,c)->data.seq==seq) ||
               // for data we match only oid
-              (type==Data && seq==0xffff && blocks[b][c].data.oid==oid) ||
+              (type==Data && seq==ANY_SEQ && CHUNK(vol,b,c)->data.oid==oid) ||
               // empty and deleted we match easily
               (type==Empty || type==Deleted) )) {
         *block=b;
         *chunk=c;
-        return &blocks[b][c];
+        COUNT(vol, scanned, scanned);
+        return CHUNK(vol,b,c);
       }
-      if(type!=Empty && blocks[b][c].type==Empty) break;
+      if(type!=Empty && CHUNK(vol,b,c)->type==Empty) break;
+    }
+  }
+  COUNT(vol, scanned, scanned);
+  return NULL;
+}
+
+
+// finds the data chunk seq of oid, unlike find_chunk() always searches
+// the whole device
+static const Chunk* find_data(STFS_Volume *vol,
+                              const uint32_t oid,
+                              const uint32_t seq,
+                              uint32_t *block, uint32_t *chunk) {
+#ifdef STFS_INDEX
+  STFS_ChunkRef ref;
+  uint32_t scanned=0;
+  for(ref=vol->data_head[data_hash(oid, seq)];ref!=NO_CHUNK;ref=vol->chunk_next[ref]) {
+    const Chunk *found=CHUNK(vol,0,ref);
+    scanned++;
+    if(found->data.oid==oid && found->data.seq==seq) {
+      *block=ref/vol->chunks_per_block;
+      *chunk=ref%vol->chunks_per_block;
+      COUNT(vol, scanned, scanned);
+      return found;
+    }
+  }
+  COUNT(vol, scanned, scanned);
+  return NULL;
+#else
+  // the chunks of a file are mostly stored one after the other, so
+  // the last chunk found and the one after it are tried first
+  const uint32_t hint=LOAD_HINT(vol);
+  const Chunk *found;
+  if(hint<vol->nblocks*vol->chunks_per_block) {
+    const uint32_t b=hint/vol->chunks_per_block;
+    uint32_t c;
+    for(c=hint%vol->chunks_per_block;c<=hint%vol->chunks_per_block+1 && c<vol->frontier[b];c++) {
+      found=CHUNK(vol,b,c);
+      COUNT(vol, scanned, 1);
+      if(found->type==Data && found->data.oid==oid && found->data.seq==seq) {
+        *block=b;
+        *chunk=c;
+        STORE_HINT(vol, CHUNK_REF(vol,b,c));
+        return found;
+      }
+    }
+  }
+  *block=*chunk=0;
+  found=find_chunk(vol, Data, oid, 0, seq, block, chunk);
+  if(found!=NULL) STORE_HINT(vol, CHUNK_REF(vol,*block,*chunk));
+  return found;
+#endif // STFS_INDEX
+}
+
+#if STFS_PATH_CACHE_SIZE > 0
+static uint32_t path_hash(const uint8_t *path, const uint32_t len) {
+  uint32_t i, h=2166136261u;
+  for(i=0;i<len;i++) {
+    h=(h ^ path[i]) * 16777619u;
+  }
+  return h;
+}
+
+static STFS_PathCacheEntry* path_cache_get(STFS_Volume *vol, const uint8_t *path, const uint32_t len, const uint32_t hash) {
+  uint32_t i;
+  for(i=0;i<STFS_PATH_CACHE_SIZE;i++) {
+    if(vol->path_cache[i].len==len && vol->path_cache[i].hash==hash &&
+       memcmp(vol->path_cache[i].path, path, len)==0) {
+      return &vol->path_cache[i];
     }
-    c=0;
   }
   return NULL;
 }
 
-static uint32_t oid_by_path(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *path, uint32_t *b, uint32_t *c) {
+static void path_cache_put(STFS_Volume *vol, const uint8_t *path, const uint32_t len, const uint32_t hash,
+                           const uint32_t oid, const uint32_t b, const uint32_t c) {
+  STFS_PathCacheEntry *entry=&vol->path_cache[vol->path_cache_next];
+  vol->path_cache_next=(vol->path_cache_next+1)%STFS_PATH_CACHE_SIZE;
+  entry->hash=hash;
+  entry->oid=oid;
+  entry->block=b;
+  entry->chunk=c;
+  entry->len=len;
+  memcpy(entry->path, path, len);
+}
+
+// must be called whenever an inode is stored, deleted or moved
+static void path_cache_clear(STFS_Volume *vol) {
+  uint32_t i;
+  for(i=0;i<STFS_PATH_CACHE_SIZE;i++) vol->path_cache[i].len=0;
+}
+#else
+#define path_cache_clear(vol) do {} while(0)
+#endif // STFS_PATH_CACHE_SIZE
+
+static uint32_t resolve_path(STFS_Volume *vol, uint8_t *path, uint32_t *b, uint32_t *c);
+
+static uint32_t oid_by_path(STFS_Volume *vol, uint8_t *path, uint32_t *b, uint32_t *c) {
   LOG(3, "[i] oid_by_path %s\n", path);
   if(path[0]==0) { // root directory virtual path is 0 size
     return 1; // oid = 1
   }
+#if STFS_PATH_CACHE_SIZE > 0
+  const uint32_t len=strlen((char*) path);
+  if(len>STFS_PATH_CACHE_PATHLEN) {
+    return resolve_path(vol, path, b, c);
+  }
+  const uint32_t hash=path_hash(path, len);
+  CACHE_LOCK(vol);
+  const STFS_PathCacheEntry *entry=path_cache_get(vol, path, len, hash);
+  if(entry!=NULL) {
+    const uint32_t oid=entry->oid;
+    if(oid!=0) {
+      *b=entry->block;
+      *c=entry->chunk;
+    }
+    CACHE_UNLOCK(vol);
+    if(oid==0) ERR(vol) = E_NOTFOUND;
+    return oid;
+  }
+  CACHE_UNLOCK(vol);
+  const uint32_t oid=resolve_path(vol, path, b, c);
+  if(oid!=0 || ERR(vol)==E_NOTFOUND) {
+    CACHE_LOCK(vol);
+    path_cache_put(vol, path, len, hash, oid, *b, *c);
+    CACHE_UNLOCK(vol);
+  }
+  return oid;
+#else
+  return resolve_path(vol, path, b, c);
+#endif // STFS_PATH_CACHE_SIZE
+}
+
+static uint32_t resolve_path(STFS_Volume *vol, uint8_t *path, uint32_t *b, uint32_t *c) {
   if(path[0]!='/') {
     // fail is not absolute path
     //printf("[x] fail is not absolute path\n");
-    errno = E_RELPATH;
+    ERR(vol) = E_RELPATH;
     return 0;
   }
 
@@ -226,18 +563,18 @@ static uint32_t oid_by_path(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *pa
         // directory name size is <0 or >32
         LOG(1, "[x] directory name size is <0 or >32\n");
         path[i]='/'; // restore path
-        errno = E_NAMESIZE;
+        ERR(vol) = E_NAMESIZE;
         return 0;
       }
       LOG(3, "[i] looking for child named: %s\n", ptr);
-      if(find_inode_by_parent_fname(blocks, parent, ptr,b,c)==NULL) {
+      if(find_inode_by_parent_fname(vol, parent, ptr,b,c)==NULL) {
         // fail no such directory
         //printf("[x] find inode by parent/fname");
         path[i]='/'; // restore path
-        errno = E_NOTFOUND;
+        ERR(vol) = E_NOTFOUND;
         return 0;
       }
-      parent=blocks[*b][*c].inode.oid;
+      parent=CHUNK(vol,*b,*c)->inode.oid;
       path[i]='/'; // restore path
       ptr=&path[i+1]; // advance start ptr
     }
@@ -246,156 +583,562 @@ static uint32_t oid_by_path(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *pa
   const uint32_t psize = strlen((char*) ptr);
   if(psize==0 || psize>32) {
     // directory name size is <0 or >32
-    errno = E_NAMESIZE;
+    ERR(vol) = E_NAMESIZE;
     return 0;
   }
-  if(find_inode_by_parent_fname(blocks, parent, ptr,b,c)==NULL) {
+  if(find_inode_by_parent_fname(vol, parent, ptr,b,c)==NULL) {
     // fail no such directory
-    errno = E_NOTFOUND;
+    ERR(vol) = E_NOTFOUND;
     return 0;
   }
-  return blocks[*b][*c].inode.oid;
+  return CHUNK(vol,*b,*c)->inode.oid;
+}
+
+static int ram_program(void *ctx, void *dst, const void *src, uint32_t size) {
+  memcpy(dst, src, size);
+  return 0;
+}
+
+static int ram_erase(void *ctx, void *block, uint32_t size) {
+  memset(block, 0xff, size);
+  return 0;
 }
 
-static int write_chunk(void *dst, void *src, uint32_t size) {
-  if(size!=sizeof(Chunk)) {
-    LOG(1, "[x] Bad chunk size: %d\n", size);
-    errno = E_BADCHUNK;
+const STFS_Backend stfs_ram_backend = { ram_program, ram_erase, NULL };
+
+// programs the first chunk_size bytes of src
+static int write_chunk(STFS_Volume *vol, Chunk *dst, const Chunk *src) {
+  COUNT(vol, programs, 1);
+  TRACE(vol, PROGRAM, ((uint8_t*) dst-vol->flash)/vol->chunk_size, vol->chunk_size);
+  if(vol->backend->program(vol->backend->ctx, dst, src, vol->chunk_size)!=0) {
+    LOG(1, "[x] failed to program chunk\n");
+    ERR(vol) = E_FLASH;
     return -1;
   }
-  memcpy(dst, src, size);
   return 0;
 }
 
-int vacuum(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK]) {
-  uint32_t i, b,c, candidate_reclaim=0, used[NBLOCKS], unused[NBLOCKS], deleted[NBLOCKS];
+// returns if new chunks can be appended to block b
+static int appendable(STFS_Volume *vol, const uint32_t b) {
+  return b<vol->nblocks && b!=vol->reserved_block && b!=vol->vac_src && b!=vol->vac_dest &&
+#if STFS_SNAPSHOTS > 0
+    b!=vol->retired &&
+#endif
+    vol->frontier[b]<vol->chunks_per_block;
+}
+
+// returns the lowest block with empty chunks that no other stream
+// appends to, else one that is shared, NBLOCKS if all are full
+static uint32_t next_append_block(STFS_Volume *vol, const uint32_t stream) {
+  uint32_t b, s, shared=NBLOCKS;
+  for(b=0;b<vol->nblocks;b++) {
+    if(!appendable(vol, b)) continue;
+    for(s=0;s<STFS_STREAMS;s++) {
+      if(s!=STREAM(stream) && vol->append_block[s]==b) break;
+    }
+    if(s==STFS_STREAMS) return b;
+    if(shared==NBLOCKS) shared=b;
+  }
+  return shared;
+}
+
+static void del_chunk(STFS_Volume *vol, const uint32_t b, const uint32_t c) {
+  Chunk chunk;
+  memset(&chunk,0,sizeof(chunk));
+  chunk.type=Deleted;
+  if(CHUNK(vol,b,c)->type==Inode || CHUNK(vol,b,c)->type==Data) {
+    vol->live_chunks[b]--;
+    vol->deleted_chunks[b]++;
+  }
+  if(CHUNK(vol,b,c)->type==Inode) path_cache_clear(vol);
+  NEW_GENERATION(vol);
+#ifdef STFS_INDEX
+  index_del(vol, b, c);
+#endif
+  COUNT(vol, deletes, 1);
+  if(PINNED(vol,b)) {
+    // a snapshot may still read the content, only clear the type
+    COUNT(vol, programs, 1);
+    TRACE(vol, PROGRAM, CHUNK_REF(vol,b,c), 1);
+    if(vol->backend->program(vol->backend->ctx, CHUNK(vol,b,c), &chunk, 1)!=0) {
+      LOG(1, "[x] failed to program chunk\n");
+    }
+    return;
+  }
+  write_chunk(vol, CHUNK(vol,b,c), &chunk);
+}
+
+// writes the header into the first chunk of the empty block b
+static int write_header(STFS_Volume *vol, const uint32_t b) {
+  Chunk header;
+  memset(&header,0xff,sizeof(header));
+  header.type=Header;
+  header.header.magic=STFS_MAGIC;
+  header.header.version=STFS_VERSION;
+  header.header.erase_count=vol->erase_count[b];
+  if(write_chunk(vol, CHUNK(vol,b,0), &header)!=0) return -1;
+  vol->frontier[b]=1;
+  return 0;
+}
+
+// blocks never erased by stfs get their header on the first append
+static int open_block(STFS_Volume *vol, const uint32_t b) {
+  return (vol->frontier[b]==0)?write_header(vol, b):0;
+}
+
+static void clear_oids(STFS_Volume *vol, const uint32_t b) {
+  vol->inode_oid_min[b]=vol->data_oid_min[b]=0xffffffff;
+  vol->inode_oid_max[b]=vol->data_oid_max[b]=0;
+}
+
+// extends the oid ranges of block b by the chunk stored in it
+static void note_oid(STFS_Volume *vol, const uint32_t b, const Chunk *chunk) {
+  if(chunk->type==Inode) {
+    if(chunk->inode.oid<vol->inode_oid_min[b]) vol->inode_oid_min[b]=chunk->inode.oid;
+    if(chunk->inode.oid>vol->inode_oid_max[b]) vol->inode_oid_max[b]=chunk->inode.oid;
+  } else if(chunk->type==Data) {
+    if(chunk->data.oid<vol->data_oid_min[b]) vol->data_oid_min[b]=chunk->data.oid;
+    if(chunk->data.oid>vol->data_oid_max[b]) vol->data_oid_max[b]=chunk->data.oid;
+  }
+}
+
+// erases block b and writes its header with the new erase count
+static void erase_block(STFS_Volume *vol, const uint32_t b) {
+  NEW_GENERATION(vol);
+  if(vol->backend->erase(vol->backend->ctx, CHUNK(vol,b,0), vol->chunks_per_block*vol->chunk_size)!=0) {
+    LOG(1, "[x] failed to erase block %d\n", b);
+  }
+  vol->vac_erases++;
+  COUNT(vol, erases, 1);
+  TRACE(vol, ERASE, b, 0);
+  vol->erase_count[b]++;
+  vol->frontier[b]=0;
+  vol->live_chunks[b]=0;
+  vol->deleted_chunks[b]=0;
+  clear_oids(vol, b);
+  write_header(vol, b);
+}
+
+// returns the least erased block holding data once the reserved block
+// has been erased more than STFS_WEAR_SPREAD times more often, or -1.
+// data that stayed on a block that long is cold, moving it to the
+// worn reserved block puts the least worn block back in rotation.
+static int wear_victim(STFS_Volume *vol) {
+#if STFS_WEAR_SPREAD > 0
+  uint32_t b;
+  int victim=-1;
+  if(vol->reserved_block>=NBLOCKS) return -1;
+  for(b=0;b<vol->nblocks;b++) {
+    if(b==vol->reserved_block || vol->live_chunks[b]==0) continue;
+    if(vol->live_chunks[b]>vol->chunks_per_block-vol->frontier[vol->reserved_block]) continue;
+    if(victim<0 || vol->erase_count[b]<vol->erase_count[victim]) victim=b;
+  }
+  if(victim>=0 && vol->erase_count[vol->reserved_block]>vol->erase_count[victim]+STFS_WEAR_SPREAD) {
+    LOG(2, "[i] wear leveling %d (%d erases) to %d (%d erases)\n", victim,
+        vol->erase_count[victim], vol->reserved_block, vol->erase_count[vol->reserved_block]);
+    return victim;
+  }
+#endif // STFS_WEAR_SPREAD
+  return -1;
+}
+
+// picks the block with the most reclaimable chunks, similar
+// candidates are picked randomly to spread the erases
+int stfs_victim_greedy(const STFS_BlockInfo *info, uint32_t nblocks) {
+  uint32_t b, candidate_reclaim=0;
   int candidate=-1;
-  for(i=0;i<NBLOCKS;i++) { used[i]=unused[i]=deleted[i]=0; }
-  //LOG(2, "[i] Block stats\n");
-  for(b=0;b<NBLOCKS;b++) {
-    for(c=0;c<CHUNKS_PER_BLOCK;c++) {
-      switch(blocks[b][c].type) {
-      case(Empty): { unused[b]++; break; }
-      case(Deleted): { deleted[b]++; break; }
-      default: { used[b]++; break; }
-      }
+  for(b=0;b<nblocks;b++) {
+    // blocks with empty chunks are still being appended to
+    if(info[b].reserved || info[b].empty>0) continue;
+    const uint32_t reclaim=info[b].empty+info[b].deleted;
+    if(reclaim>candidate_reclaim) {
+      LOG(1, "[i] old, new can: %d %d (%d>%d)\n", candidate, b, reclaim,candidate_reclaim);
+      candidate=b;
+      candidate_reclaim=reclaim;
+    } else if(reclaim>(candidate_reclaim*9)/10 && random()%4==0) {
+      LOG(1, "[i] lucky old, new can: %d %d (%d>%d)\n", candidate, b, reclaim,candidate_reclaim);
+      candidate=b;
+      candidate_reclaim=reclaim;
     }
-    if(b==reserved_block) continue;
-    if((unused[b]+deleted[b])>candidate_reclaim) {
-      LOG(1, "[i] old, new can: %d %d (%d>%d)\n", candidate, b, (unused[b]+deleted[b]),candidate_reclaim);
+  }
+  return candidate;
+}
+
+// like greedy, but ties go to the lowest block, for reproducible runs
+int stfs_victim_deterministic(const STFS_BlockInfo *info, uint32_t nblocks) {
+  uint32_t b, candidate_reclaim=0;
+  int candidate=-1;
+  for(b=0;b<nblocks;b++) {
+    if(info[b].reserved || info[b].empty>0) continue;
+    if(info[b].deleted>candidate_reclaim) {
       candidate=b;
-      candidate_reclaim=(unused[b]+deleted[b]);
-    } else if((unused[b]+deleted[b])>(candidate_reclaim*9)/10 && random()%4==0) {
-      LOG(1, "[i] lucky old, new can: %d %d (%d>%d)\n", candidate, b, (unused[b]+deleted[b]),candidate_reclaim);
+      candidate_reclaim=info[b].deleted;
+    }
+  }
+  return candidate;
+}
+
+// weighs the reclaimed chunks by the age of the block against the cost
+// of reading the block and copying its live chunks (sprite lfs), old
+// blocks are unlikely to lose more chunks if vacuuming is postponed
+int stfs_victim_cost_benefit(const STFS_BlockInfo *info, uint32_t nblocks) {
+  uint64_t candidate_score=0;
+  uint32_t b;
+  int candidate=-1;
+  for(b=0;b<nblocks;b++) {
+    if(info[b].reserved || info[b].empty>0 || info[b].deleted==0) continue;
+    const uint32_t size=info[b].live+info[b].deleted+info[b].empty;
+    const uint64_t score=((uint64_t) info[b].age+1)*info[b].deleted*size/(size+info[b].live);
+    if(score>candidate_score) {
       candidate=b;
-      candidate_reclaim=(unused[b]+deleted[b]);
+      candidate_score=score;
     }
   }
-  for(b=0;b<NBLOCKS;b++) {
-    LOG(2, "\t%d %4d %4d %4d\n", b, unused[b], used[b], deleted[b]);
+  return candidate;
+}
+
+void stfs_set_victim_policy(STFS_Volume *vol, STFS_VictimPolicy policy) {
+  vol->victim_policy=(policy!=NULL)?policy:stfs_victim_greedy;
+}
+
+static int block_info(STFS_Volume *vol, uint32_t block, STFS_BlockInfo *info);
+
+// returns the block to vacuum, or -1 if no block is worth it
+static int pick_victim(STFS_Volume *vol) {
+  STFS_BlockInfo info[NBLOCKS];
+  uint32_t b;
+  for(b=0;b<vol->nblocks;b++) {
+    block_info(vol, b, &info[b]);
+    LOG(2, "\t%d %4d %4d %4d\n", b, info[b].empty, info[b].live, info[b].deleted);
   }
+  return vol->victim_policy(info, vol->nblocks);
+}
+
+static int vacuum_start(STFS_Volume *vol, const int candidate) {
   if(candidate<0) {
     // fail
-    LOG(1, "[x] vacuum reserved: %d candidate: %d\n", reserved_block, candidate);
-    errno = E_VAC;
+    LOG(1, "[x] vacuum reserved: %d candidate: %d\n", vol->reserved_block, candidate);
+    ERR(vol) = E_VAC;
     return -1;
   }
-  if(candidate>=NBLOCKS) {
+  if(candidate>=vol->nblocks) {
     // fail
-    LOG(1, "[x] vacuum invalid block: %d candidate: %d\n", reserved_block, candidate);
-    errno = E_VAC;
+    LOG(1, "[x] vacuum invalid block: %d candidate: %d\n", vol->reserved_block, candidate);
+    ERR(vol) = E_VAC;
+    return -1;
+  }
+  if(vol->reserved_block>=NBLOCKS) {
+    // fail, the last victim is retired until snapshots are released
+    LOG(1, "[x] vacuum has no reserved block\n");
+    ERR(vol) = E_VAC;
     return -1;
   }
-  LOG(2, "[i] vacuuming from %d to %d\n", candidate, reserved_block);
-  i=0;
-  for(c=0;c<CHUNKS_PER_BLOCK;c++) {
-    if(blocks[candidate][c].type==Inode || blocks[candidate][c].type==Data) {
-      write_chunk(&blocks[reserved_block][i++], &blocks[candidate][c], sizeof(Chunk));
+  if(open_block(vol, vol->reserved_block)!=0) return -1;
+  if(vol->live_chunks[candidate]>vol->chunks_per_block-vol->frontier[vol->reserved_block]) {
+    // fail, a block without header does not fit into one with
+    LOG(1, "[x] vacuum %d does not fit into %d\n", candidate, vol->reserved_block);
+    ERR(vol) = E_VAC;
+    return -1;
+  }
+  LOG(2, "[i] vacuuming from %d to %d\n", candidate, vol->reserved_block);
+  COUNT(vol, vacuums, 1);
+  // the reserved block becomes the destination, it is readable but
+  // closed for appending until the vacuum is finished
+  vol->vac_src=candidate;
+  vol->vac_dest=vol->reserved_block;
+  vol->vac_pos=0;
+  vol->reserved_block=NBLOCKS;
+  // the copies are as old as the chunks they are copied from
+  vol->block_stamp[vol->vac_dest]=vol->block_stamp[vol->vac_src];
+  return 0;
+}
+
+// copies up to budget live chunks from vac_src to vac_dest, once all
+// are copied vac_src is erased and becomes the reserved block.
+// returns 1 if chunks are left to copy, 0 if the vacuum is finished.
+static int copy_victim(STFS_Volume *vol, uint32_t budget) {
+  // nothing can interleave if we finish now, so the originals need
+  // not be deleted, vac_src is erased anyway. unless a snapshot pins
+  // it, then it must not be found while it is retired.
+  const int finish=(budget>=vol->chunks_per_block) && !PINNED(vol,vol->vac_src);
+  if(finish) path_cache_clear(vol);
+  for(;vol->vac_pos<vol->frontier[vol->vac_src];vol->vac_pos++) {
+    Chunk *chunk=CHUNK(vol,vol->vac_src,vol->vac_pos);
+    if(chunk->type!=Inode && chunk->type!=Data) continue;
+    if(budget==0) return 1;
+    const uint32_t c=vol->frontier[vol->vac_dest];
+    write_chunk(vol, CHUNK(vol,vol->vac_dest,c), chunk);
+    vol->vac_copies++;
+    COUNT(vol, copies, 1);
+    vol->frontier[vol->vac_dest]++;
+    vol->live_chunks[vol->vac_dest]++;
+    note_oid(vol, vol->vac_dest, chunk);
+#ifdef STFS_INDEX
+    index_add(vol, vol->vac_dest, c);
+#endif
+    if(finish) {
+#ifdef STFS_INDEX
+      index_del(vol, vol->vac_src, vol->vac_pos);
+#endif
+    } else {
+      // only the copy may be found and updated from now on
+      del_chunk(vol, vol->vac_src, vol->vac_pos);
     }
+    budget--;
+  }
+#if STFS_SNAPSHOTS > 0
+  if(PINNED(vol,vol->vac_src)) {
+    // snapshots still read vac_src, it is erased by reclaim()
+    LOG(2, "[i] retiring %d\n", vol->vac_src);
+    vol->retired=vol->vac_src;
+    vol->vac_src=vol->vac_dest=NBLOCKS;
+    return 0;
   }
+#endif // STFS_SNAPSHOTS
   // erase candidate
-  memset(&blocks[candidate],0xff,CHUNKS_PER_BLOCK*CHUNK_SIZE);
-  reserved_block=candidate;
+  erase_block(vol, vol->vac_src);
+  vol->reserved_block=vol->vac_src;
+  vol->vac_src=vol->vac_dest=NBLOCKS;
   return 0;
 }
 
-static int store_chunk(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], Chunk *chunk) {
-  uint32_t b=0, c=0;
+static int vacuum_run(STFS_Volume *vol, uint32_t budget) {
+#ifdef STFS_TRACE
+  const uint32_t victim=vol->vac_src, copies=vol->vac_copies;
+  TRACE(vol, VACUUM, victim, vol->vac_dest);
+  const int ret=copy_victim(vol, budget);
+  TRACE(vol, VACUUMED, victim, vol->vac_copies-copies);
+  return ret;
+#else
+  return copy_victim(vol, budget);
+#endif // STFS_TRACE
+}
+
+#if STFS_SNAPSHOTS > 0
+// erases the retired block once no snapshot reads it anymore, it
+// becomes the reserved block
+static void reclaim(STFS_Volume *vol) {
+  if(vol->retired>=NBLOCKS || PINNED(vol,vol->retired)) return;
+  erase_block(vol, vol->retired);
+  vol->reserved_block=vol->retired;
+  vol->retired=NBLOCKS;
+}
+#else
+#define reclaim(vol) do {} while(0)
+#endif // STFS_SNAPSHOTS
+
+// vacuums synchronously, first finishing a running incremental vacuum
+static int vacuum(STFS_Volume *vol) {
+  reclaim(vol);
+  if(vol->vac_src<NBLOCKS) {
+    vacuum_run(vol, vol->chunks_per_block);
+    if(next_append_block(vol, STREAM_META)<NBLOCKS) return 0;
+  }
+  const int worn=wear_victim(vol);
+  if(worn>=0 && vacuum_start(vol, worn)==0) {
+    vacuum_run(vol, vol->chunks_per_block);
+    if(next_append_block(vol, STREAM_META)<NBLOCKS) return 0;
+  }
+  if(vacuum_start(vol, pick_victim(vol))!=0) return -1;
+  vacuum_run(vol, vol->chunks_per_block);
+  return 0;
+}
+
+static int vacuum_step(STFS_Volume *vol, uint32_t budget) {
+  reclaim(vol);
+  if(vol->vac_src>=NBLOCKS) {
+    if(vol->reserved_block>=NBLOCKS) {
+      // the last victim is still retired, nothing to do until then
+      return 0;
+    }
+    int candidate=wear_victim(vol);
+    if(candidate<0) candidate=pick_victim(vol);
+    if(candidate<0) {
+      // no full block with deleted chunks, nothing to gain
+      return 0;
+    }
+    if(vacuum_start(vol, candidate)!=0) return -1;
+  }
+  return vacuum_run(vol, budget);
+}
+
+int stfs_vacuum_step(STFS_Volume *vol, uint32_t budget) {
+  WRITE_LOCK(vol);
+  TRACE_BEGIN(vol, VACUUM_STEP, 0, budget);
+  const int ret=vacuum_step(vol, budget);
+  TRACE_END(vol, VACUUM_STEP, ret);
+  UNLOCK(vol);
+  return ret;
+}
+
+static int store_chunk(STFS_Volume *vol, Chunk *chunk, const uint32_t stream) {
   //printf("[i] store_chunk\n");
-  if(find_chunk(blocks, Empty, 0, 0, 0, &b, &c)==NULL) {
+  uint32_t *append=&vol->append_block[STREAM(stream)];
+  if(!appendable(vol, *append)) {
+    // append block is full, continue in the next one
+    *append=next_append_block(vol, stream);
+  }
+  if(*append>=NBLOCKS) {
         // no no free chunk found try to vacuum
-        if(vacuum(blocks)!=0) {
+        if(vacuum(vol)!=0) {
           // failed vacuuming filesystem is full
           LOG(1, "[!] device is full\n");
-          errno = E_FULL;
+          ERR(vol) = E_FULL;
           return -1;
         }
         // vacuum successful
-        b=c=0;
-        if(find_chunk(blocks, Empty, 0, 0, 0, &b, &c)==NULL) {
+        *append=next_append_block(vol, stream);
+        if(*append>=NBLOCKS) {
           // fail no empty chunk found - should be impossible,
           // since we just vacuumed
           LOG(1, "[!] has no free chunk! even after vacuuming!\n");
-          errno = E_FULL;
+          ERR(vol) = E_FULL;
           return -1;
         }
   }
+  const uint32_t b=*append;
+  if(open_block(vol, b)!=0) return -1;
+  const uint32_t c=vol->frontier[b];
   //printf("[i] storing to %d %d\n", b,c);
-  return write_chunk(&blocks[b][c], chunk, sizeof(*chunk));
+  if(write_chunk(vol, CHUNK(vol,b,c), chunk)!=0) return -1;
+  vol->frontier[b]++;
+  vol->live_chunks[b]++;
+  note_oid(vol, b, chunk);
+  vol->block_stamp[b]=++vol->write_clock;
+  if(chunk->type==Inode) path_cache_clear(vol);
+#ifdef STFS_INDEX
+  index_add(vol, b, c);
+#endif
+  return 0;
 }
 
-static uint8_t is_oid_available(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], const uint32_t oid) {
-  uint32_t b,c, fd;
-  if (oid < 2) return 0;
-  for(fd=0;fd<MAX_OPEN_FILES;fd++) {
-    if(fdesc[fd].free==0 && fdesc[fd].ichunk.inode.oid == oid) return 0;
+// finds the first range of unused oids starting at from, needs a
+// full pass over the device per used oid at the start of the range,
+// but is only called once the oids above the high-water mark are
+// exhausted.
+static void find_free_oids(STFS_Volume *vol, uint32_t from) {
+  uint32_t b,c, fd, oid, lowest;
+  if(from<OID_FIRST) from=OID_FIRST;
+  for(;;) {
+    lowest=0xffffffff;
+    for(fd=0;fd<MAX_OPEN_FILES;fd++) {
+      oid=vol->fdesc[fd].ichunk.inode.oid;
+      if(vol->fdesc[fd].free==0 && oid>=from && oid<lowest) lowest=oid;
+    }
+    for(b=0;b<vol->nblocks;b++) {
+      if(b==vol->reserved_block) continue;
+      for(c=0;c<vol->frontier[b];c++) {
+        if(CHUNK(vol,b,c)->type==Inode) oid=CHUNK(vol,b,c)->inode.oid;
+        else if(CHUNK(vol,b,c)->type==Data) oid=CHUNK(vol,b,c)->data.oid;
+        else continue;
+        if(oid>=from && oid<lowest) lowest=oid;
+      }
+    }
+    if(lowest!=from) break;
+    from++;
   }
-  for(b=0;b<NBLOCKS;b++) {
-    if(b==reserved_block) continue;
-    for(c=0;c<CHUNKS_PER_BLOCK;c++) {
-      if(blocks[b][c].type==Inode && blocks[b][c].inode.oid == oid) return 0;
-      if(blocks[b][c].type==Data && blocks[b][c].data.oid == oid) return 0;
+  LOG(2, "[i] free oids %x - %x\n", from, lowest);
+  vol->oid_next=from;
+  vol->oid_limit=lowest;
+}
+
+static uint32_t new_oid(STFS_Volume *vol) {
+  if(vol->oid_next>=vol->oid_limit) {
+    // oids above the high-water mark are used up, wrap around
+    find_free_oids(vol, (vol->oid_limit==0xffffffff)?OID_FIRST:vol->oid_limit+1);
+    if(vol->oid_next>=vol->oid_limit) {
+      // this should never be reached!
+      return 0;
     }
   }
-  return 1;
+  LOG(3,"[i] returning new oid %d\n", vol->oid_next);
+  return vol->oid_next++;
 }
 
-static uint32_t new_oid(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK]) {
-  uint32_t oid = current_oid_offset + 1 ;
-  uint32_t i;
-  for(i=0; i < OID_BLOCK_SIZE; i++) {
-    if(is_oid_available(blocks, oid+i)) {
-      if(0xFFFFFFFF-OID_BLOCK_SIZE < current_oid_offset) {
-        current_oid_offset = OID_START_OFFSET;
-      } else {
-        current_oid_offset += OID_BLOCK_SIZE;
+// deletes all data chunks of oid with a seq of at least from, in a
+// single pass over the device
+static void del_chunks(STFS_Volume *vol, const uint32_t oid, const uint32_t from) {
+  uint32_t b, c, n=0;
+  for(b=0;b<vol->nblocks;b++) {
+    if(b==vol->reserved_block || vol->live_chunks[b]==0) continue;
+    if(oid<vol->data_oid_min[b] || oid>vol->data_oid_max[b]) continue;
+    COUNT(vol, scanned, vol->frontier[b]);
+    for(c=0;c<vol->frontier[b];c++) {
+      if(CHUNK(vol,b,c)->type==Data &&
+         CHUNK(vol,b,c)->data.oid==oid &&
+         CHUNK(vol,b,c)->data.seq>=from) {
+        del_chunk(vol, b, c);
+        n++;
       }
-      LOG(3,"[i] returning new oid %d\n", oid+i);
-      return oid+i;
     }
   }
-  // this should never be reached!
-  return 0;
+  LOG(3,"[i] deleted %d chunks from oid %x\n",n, oid);
 }
 
-static void del_chunk(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], const uint32_t b, const uint32_t c) {
-  Chunk chunk;
-  memset(&chunk,0,sizeof(chunk));
-  chunk.type=Deleted;
-  write_chunk(&blocks[b][c], &chunk, sizeof(chunk));
+// the data area of an external inode journals its size: a close that
+// only changed the size programs the new size into the next erased
+// word instead of storing a new inode. the last programmed word is the
+// size, the size field while none is.
+#define JOURNAL_SLOTS(vol) (STFS_INLINE_DATA_SIZE(vol)/4)
+#define JOURNAL_EMPTY 0xffffffff
+
+// returns the number of programmed journal words
+static uint32_t journal_len(STFS_Volume *vol, const Inode_t *inode) {
+  uint32_t i, word;
+  for(i=0;i<JOURNAL_SLOTS(vol);i++) {
+    memcpy(&word, inode->data+4*i, 4);
+    if(word==JOURNAL_EMPTY) break;
+  }
+  return i;
+}
+
+static uint32_t inode_size(STFS_Volume *vol, const Inode_t *inode) {
+  uint32_t size=inode->size;
+  if(inode->external==0) return size;
+  const uint32_t n=journal_len(vol, inode);
+  if(n>0) memcpy(&size, inode->data+4*(n-1), 4);
+  return size;
 }
 
+// copies the inode src from flash to dst with its journal folded into
+// the size field
+static void load_inode(STFS_Volume *vol, Inode_t *dst, const Inode_t *src) {
+  // chunks are only as large as the volume's
+  memcpy(dst, src, vol->chunk_size-1);
+  if(dst->external==0) return;
+  dst->size=inode_size(vol, src);
+  memset(dst->data, 0xff, STFS_INLINE_DATA_SIZE(vol));
+}
+
+// programs the size of ichunk into the journal of the inode at b,c, if
+// that is all that changed. stored is the inode as load_inode() gets
+// it. returns -1 if a new inode has to be stored instead.
+static int journal_size(STFS_Volume *vol, const uint32_t b, const uint32_t c, const Chunk *stored,
+                        const Chunk *ichunk) {
+  Chunk update;
+  if(stored->inode.external==0 || ichunk->inode.external==0) return -1;
+  const uint32_t n=journal_len(vol, &CHUNK(vol,b,c)->inode);
+  if(n>=JOURNAL_SLOTS(vol)) return -1;
+  memcpy(&update, stored, vol->chunk_size);
+  update.inode.size=ichunk->inode.size;
+  if(memcmp(&update, ichunk, vol->chunk_size)!=0) return -1;
+  memcpy(&update, CHUNK(vol,b,c), vol->chunk_size);
+  memcpy(update.inode.data+4*n, &ichunk->inode.size, 4);
+  if(write_chunk(vol, CHUNK(vol,b,c), &update)!=0) return -1;
+  COUNT(vol, in_place, 1);
+  return 0;
+}
 
-int opendir(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *path, ReaddirCTX *ctx) {
+static int open_dir(STFS_Volume *vol, uint8_t *path, ReaddirCTX *ctx) {
   memset((uint8_t*) ctx,0,sizeof(*ctx));
   const uint32_t last=strlen((char*) path)-1;
   uint32_t oid, b=0, c=0;
   if(path[last]=='/') {
     path[last]=0;
-    oid = oid_by_path(blocks, path,&b,&c);
+    oid = oid_by_path(vol, path,&b,&c);
     path[last]='/';
   } else {
-    oid = oid_by_path(blocks, path,&b,&c);
+    oid = oid_by_path(vol, path,&b,&c);
   }
   if(oid==0) {
     // fail path not found
@@ -408,19 +1151,38 @@ int opendir(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *path, ReaddirCTX *
   return 0;
 }
 
-const Inode_t* readdir(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], ReaddirCTX *ctx) {
-  const Chunk *chunk=find_chunk(blocks, Inode, 0, ctx->oid, 0, &(ctx->block), &(ctx->chunk));
+int opendir(STFS_Volume *vol, uint8_t *path, ReaddirCTX *ctx) {
+  READ_LOCK(vol);
+  TRACE_BEGIN(vol, OPENDIR, 0, 0);
+  const int ret=open_dir(vol, path, ctx);
+  TRACE_END(vol, OPENDIR, ret);
+  UNLOCK(vol);
+  return ret;
+}
+
+static const Inode_t* read_dir(STFS_Volume *vol, ReaddirCTX *ctx) {
+  const Chunk *chunk=find_chunk(vol, Inode, 0, ctx->oid, 0, &(ctx->block), &(ctx->chunk));
   if(chunk==NULL) return NULL;
-  if(ctx->chunk+1>=CHUNKS_PER_BLOCK) {
+  if(ctx->chunk+1>=vol->chunks_per_block) {
     ctx->block++;
     ctx->chunk=0;
   } else {
     ctx->chunk++;
   }
-  return &chunk->inode;
+  load_inode(vol, &ctx->inode, &chunk->inode);
+  return &ctx->inode;
+}
+
+const Inode_t* readdir(STFS_Volume *vol, ReaddirCTX *ctx) {
+  READ_LOCK(vol);
+  TRACE_BEGIN(vol, READDIR, ctx->oid, 0);
+  const Inode_t *ret=read_dir(vol, ctx);
+  TRACE_END(vol, READDIR, ret!=NULL);
+  UNLOCK(vol);
+  return ret;
 }
 
-static uint8_t* split_path(uint8_t *path) {
+static uint8_t* split_path(STFS_Volume *vol, uint8_t *path) {
   uint32_t i;
   uint8_t* ptr=NULL;
   for(i=0;path[i]!=0 && i<0xffffffff;i++) {
@@ -428,64 +1190,58 @@ static uint8_t* split_path(uint8_t *path) {
   }
   if(ptr==NULL) {
     // fail, not an absolute path
-    errno = E_RELPATH;
+    ERR(vol) = E_RELPATH;
     return NULL;
   }
   *ptr=0; // terminate path
   return ptr+1;
 }
 
-static int create_obj(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *path, Chunk *chunk) {
+static int create_obj(STFS_Volume *vol, uint8_t *path, Chunk *chunk) {
   int ret=0;
-  uint8_t *fname=split_path(path);
+  uint8_t *fname=split_path(vol, path);
   if(fname==NULL) {
-    errno=E_INVNAME;
+    ERR(vol)=E_INVNAME;
     return -1;
   }
   if(chunk==NULL) {
-    errno=E_NOCHUNK;
+    ERR(vol)=E_NOCHUNK;
     ret=-1;
     goto exit;
   }
   if(memcmp(fname, "..", 3)==0 ||
      memcmp(fname, ".", 2)==0 ||
      fname[0]==0) {
-    errno = E_INVNAME;
+    ERR(vol) = E_INVNAME;
     ret=-1;
     goto exit;
   }
 
   //printf("[i] split path: '%s' fname: '%s'\n", path, fname);
   uint32_t b=0,c=0;
-  const uint32_t parent=oid_by_path(blocks, path,&b,&c);
+  const uint32_t parent=oid_by_path(vol, path,&b,&c);
   if(parent==0) {
     LOG(1, "[x] '%s' not found by oid\n", path);
     // fail no such directory
-    errno = E_NOTFOUND;
+    ERR(vol) = E_NOTFOUND;
     ret=-1;
     goto exit;
   }
   // check if parent is a directory
-  if(parent!=1 && blocks[b][c].inode.type!=Directory) {
+  if(parent!=1 && CHUNK(vol,b,c)->inode.type!=Directory) {
     // parent is a file
-    errno = E_WRONGOBJ;
+    ERR(vol) = E_WRONGOBJ;
     ret=-1;
     goto exit;
   }
 
   // check if object already exists
-  ReaddirCTX ctx={.oid=parent,.block=0,.chunk=0};
-  const Inode_t *inode;
-  const uint32_t fsize=strlen((char*) fname);
-  while((inode=readdir(blocks, &ctx))!=0) {
-    if(fsize==inode->name_len &&
-       memcmp(inode->name, fname, inode->name_len)==0) {
-      // fail parent has already a child named fname
-      LOG(1, "[x] '%s' has already a child %s\n", path, fname);
-      errno = E_EXISTS;
-      ret=-1;
-      goto exit;
-    }
+  if(find_inode_by_parent_fname(vol, parent, fname, &b, &c)!=NULL) {
+    // fail parent has already a child named fname
+    LOG(1, "[x] '%s' has already a child %s\n", path, fname);
+    ERR(vol) = E_EXISTS;
+    ret=-1;
+    goto exit;
   }
 
   LOG(3, "[i] parent inode: %x\n", parent);
@@ -493,7 +1249,7 @@ static int create_obj(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *path, Ch
   if(nsize>32 || nsize <1) {
     // fail name not valid size
     LOG(1, "invalid fname size\n");
-    errno = E_NAMESIZE;
+    ERR(vol) = E_NAMESIZE;
     ret=-1;
     goto exit;
   }
@@ -506,7 +1262,7 @@ static int create_obj(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *path, Ch
   return ret;
 }
 
-int stfs_mkdir(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *path) {
+static int make_dir(STFS_Volume *vol, uint8_t *path) {
   LOG(2, "[x] mkdir %s\n", path);
 
   Chunk chunk;
@@ -514,17 +1270,17 @@ int stfs_mkdir(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *path) {
   chunk.type=Inode;
   chunk.inode.type=Directory;
   chunk.inode.size=0;
-  chunk.inode.oid=new_oid(blocks);
+  chunk.inode.oid=new_oid(vol);
   //printf("[i] new oid: 0x%x\n", chunk.inode.oid);
 
-  if(create_obj(blocks, path, &chunk)==-1) {
+  if(create_obj(vol, path, &chunk)==-1) {
     // fail
     LOG(1, "[x] create obj failed\n");
     return -1;
   }
 
   // store chunk
-  if(store_chunk(blocks, &chunk)==-1) {
+  if(store_chunk(vol, &chunk, STREAM_META)==-1) {
     // fail to store chunk
     LOG(1, "failed to store chunk\n");
     return -1;
@@ -532,9 +1288,18 @@ int stfs_mkdir(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *path) {
   return 0;
 }
 
-int stfs_rmdir(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *path) {
+int stfs_mkdir(STFS_Volume *vol, uint8_t *path) {
+  WRITE_LOCK(vol);
+  TRACE_BEGIN(vol, MKDIR, 0, 0);
+  const int ret=make_dir(vol, path);
+  TRACE_END(vol, MKDIR, ret);
+  UNLOCK(vol);
+  return ret;
+}
+
+static int remove_dir(STFS_Volume *vol, uint8_t *path) {
   uint32_t b=0, c=0;
-  const uint32_t self=oid_by_path(blocks, path, &b, &c);
+  const uint32_t self=oid_by_path(vol, path, &b, &c);
   if(self==0) {
     LOG(1, "[x] path doesn't exist '%s'\n", path);
     // fail no such directory
@@ -543,11 +1308,11 @@ int stfs_rmdir(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *path) {
   if(self==1) {
     LOG(1, "[x] can't delete /\n");
     // fail no such directory
-    errno = E_DELROOT;
+    ERR(vol) = E_DELROOT;
     return -1;
   }
   // check if self is indeed a directory
-  if(blocks[b][c].type==Inode && blocks[b][c].inode.type!=Directory) {
+  if(CHUNK(vol,b,c)->type==Inode && CHUNK(vol,b,c)->inode.type!=Directory) {
     // fail
     LOG(1, "[x] path '%s' is not a directory\n", path);
     return -1;
@@ -555,505 +1320,1136 @@ int stfs_rmdir(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *path) {
 
   // check if directory is empty
   ReaddirCTX ctx={.oid=self, .block=0, .chunk=0};
-  if(readdir(blocks, &ctx)!=0) {
+  if(read_dir(vol, &ctx)!=0) {
     // fail directory is not empty
     LOG(1, "[x] directory '%s' is not empty\n", path);
     return -1;
   }
 
   // del chunk
-  del_chunk(blocks, b, c);
+  del_chunk(vol, b, c);
   return 0;
 }
 
-int stfs_geterrno(void) {
-  return errno;
+int stfs_rmdir(STFS_Volume *vol, uint8_t *path) {
+  WRITE_LOCK(vol);
+  TRACE_BEGIN(vol, RMDIR, 0, 0);
+  const int ret=remove_dir(vol, path);
+  TRACE_END(vol, RMDIR, ret);
+  UNLOCK(vol);
+  return ret;
+}
+
+int stfs_geterrno(STFS_Volume *vol) {
+  return ERR(vol);
 }
 
-int stfs_open(uint8_t *path, uint32_t oflag, Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK]) {
+static int open_file(uint8_t *path, uint32_t oflag, STFS_Volume *vol) {
   // oflag maybe: O_RDONLY O_RDWR O_WRONLY O_SYNC(caching?) O_EXCL
   // oflags: O_APPEND O_CREAT O_TRUNC(seek)
 
   // find free fdesc
   uint32_t fd;
   for(fd=0;fd<MAX_OPEN_FILES;fd++) {
-    if(fdesc[fd].free!=0) break;
+    if(vol->fdesc[fd].free!=0) break;
   }
   if(fd>=MAX_OPEN_FILES) {
     // fail no free file descriptors available
-    errno = E_NOFDS;
+    ERR(vol) = E_NOFDS;
     return -1;
   }
 
-  memset(&fdesc[fd], 0xff, sizeof(STFS_File));
+  memset(&vol->fdesc[fd], 0xff, sizeof(STFS_File));
+#ifdef STFS_WRITE_BUFFER
+  vol->fdesc[fd].wbuf_len=0;
+#endif // STFS_WRITE_BUFFER
 
   if(oflag == O_CREAT) {
     // create file
 
     // check if file doesn't exist
     uint32_t b=0, c=0;
-    const uint32_t self=oid_by_path(blocks, path, &b, &c);
+    const uint32_t self=oid_by_path(vol, path, &b, &c);
     if(self!=0) {
       LOG(1, "[x] path already exists '%s'\n", path);
       // fail no such directory
-      errno = E_EXISTS;
+      ERR(vol) = E_EXISTS;
       return -1;
     }
 
-    if(create_obj(blocks, path, &fdesc[fd].ichunk)==-1) {
+    if(create_obj(vol, path, &vol->fdesc[fd].ichunk)==-1) {
       // fail
       LOG(1, "[x] create obj failed\n");
       return -1;
     }
     uint32_t i;
     for(i=0;i<MAX_OPEN_FILES;i++) {
-      if(i==fd ||fdesc[i].free!=0) continue;
-      if(fdesc[i].ichunk.inode.name_len == fdesc[fd].ichunk.inode.name_len &&
-         fdesc[i].ichunk.inode.parent == fdesc[fd].ichunk.inode.parent &&
-         memcmp(fdesc[i].ichunk.inode.name, fdesc[fd].ichunk.inode.name, fdesc[fd].ichunk.inode.name_len)==0) {
+      if(i==fd ||vol->fdesc[i].free!=0) continue;
+      if(vol->fdesc[i].ichunk.inode.name_len == vol->fdesc[fd].ichunk.inode.name_len &&
+         vol->fdesc[i].ichunk.inode.parent == vol->fdesc[fd].ichunk.inode.parent &&
+         memcmp(vol->fdesc[i].ichunk.inode.name, vol->fdesc[fd].ichunk.inode.name, vol->fdesc[fd].ichunk.inode.name_len)==0) {
         LOG(1, "[x] double open\n");
-        errno = E_FDREOPEN;
+        ERR(vol) = E_FDREOPEN;
         return -1;
       }
     }
 
-    fdesc[fd].idirty=1;
-    fdesc[fd].free=0;
-    fdesc[fd].fptr=0;
-    fdesc[fd].ichunk.type=Inode;
-    fdesc[fd].ichunk.inode.type=File;
-    fdesc[fd].ichunk.inode.size=0;
-    fdesc[fd].ichunk.inode.oid=new_oid(blocks);
+    vol->fdesc[fd].idirty=1;
+    vol->fdesc[fd].free=0;
+    vol->fdesc[fd].fptr=0;
+    vol->fdesc[fd].ichunk.type=Inode;
+    vol->fdesc[fd].ichunk.inode.type=File;
+    vol->fdesc[fd].ichunk.inode.external=0;
+    vol->fdesc[fd].ichunk.inode.size=0;
+    vol->fdesc[fd].ichunk.inode.oid=new_oid(vol);
 
-    if(store_chunk(blocks, &fdesc[fd].ichunk)==-1) {
+    if(store_chunk(vol, &vol->fdesc[fd].ichunk, STREAM_META)==-1) {
       return -1;
     }
 
     return fd;
   } else if(oflag == 0) {
     uint32_t b=0, c=0;
-    const uint32_t self=oid_by_path(blocks, path, &b, &c);
+    const uint32_t self=oid_by_path(vol, path, &b, &c);
     if(self==0) {
       LOG(1, "[x] path not found '%s'\n", path);
       // fail no such file
       return -1;
     }
-    if(self==1 || blocks[b][c].inode.type!=File) {
+    if(self==1 || CHUNK(vol,b,c)->inode.type!=File) {
       LOG(1, "[x] cannot open directory '%s'\n", path);
-      errno = E_OPEN;
+      ERR(vol) = E_OPEN;
       // fail no such file
       return -1;
     }
-    fdesc[fd].idirty=0;
-    fdesc[fd].free=0;
-    fdesc[fd].fptr=0;
-    memcpy(&fdesc[fd].ichunk, &blocks[b][c], sizeof(Chunk));
+    vol->fdesc[fd].idirty=0;
+    vol->fdesc[fd].free=0;
+    vol->fdesc[fd].fptr=0;
+    vol->fdesc[fd].ichunk.type=Inode;
+    load_inode(vol, &vol->fdesc[fd].ichunk.inode, &CHUNK(vol,b,c)->inode);
     return fd;
   }
   return -1;
 }
 
-off_t stfs_lseek(uint32_t fildes, off_t offset, int whence) {
-  VALIDFD(fildes);
-  uint32_t newfptr=fdesc[fildes].fptr;
+int stfs_open(uint8_t *path, uint32_t oflag, STFS_Volume *vol) {
+  // also claims a descriptor, so opening never runs in parallel
+  WRITE_LOCK(vol);
+  TRACE_BEGIN(vol, OPEN, 0, oflag);
+  const int ret=open_file(path, oflag, vol);
+  TRACE_END(vol, OPEN, ret);
+  UNLOCK(vol);
+  return ret;
+}
+
+#ifdef STFS_WRITE_BUFFER
+static int flush_wbuf(uint32_t fildes, STFS_Volume *vol);
+#endif // STFS_WRITE_BUFFER
+
+static off_t seek_file(uint32_t fildes, off_t offset, int whence, STFS_Volume *vol) {
+  VALIDFD(vol,fildes);
+  uint32_t newfptr=vol->fdesc[fildes].fptr;
   switch(whence) {
   case(SEEK_SET): {newfptr=offset; break;}
   case(SEEK_CUR): {newfptr+=offset; break;}
-  case(SEEK_END): {newfptr=fdesc[fildes].ichunk.inode.size+offset; break;}}
-  if(newfptr>fdesc[fildes].ichunk.inode.size) {
+  case(SEEK_END): {newfptr=vol->fdesc[fildes].ichunk.inode.size+offset; break;}}
+  if(newfptr>vol->fdesc[fildes].ichunk.inode.size) {
     // fail seek beyond eof
     LOG(1, "[x] cannot seek beyond eof set\n");
-    errno = E_NOSEEKEOF;
+    ERR(vol) = E_NOSEEKEOF;
     return -1;
   }
-  fdesc[fildes].fptr=newfptr;
+#ifdef STFS_WRITE_BUFFER
+  const STFS_File *f=&vol->fdesc[fildes];
+  if(f->wbuf_len>0 && (newfptr<f->wbuf_pos || newfptr>f->wbuf_pos+f->wbuf_len)) {
+    // the writes are not continued, no reason to hold them back
+    if(flush_wbuf(fildes, vol)!=0) return -1;
+  }
+#endif // STFS_WRITE_BUFFER
+  vol->fdesc[fildes].fptr=newfptr;
   return newfptr;
 }
 
-uint32_t stfs_size(uint32_t fildes) {
-  VALIDFD(fildes);
-  return fdesc[fildes].ichunk.inode.size;
+off_t stfs_lseek(uint32_t fildes, off_t offset, int whence, STFS_Volume *vol) {
+  READ_LOCK(vol);
+#if defined(STFS_THREADS) && defined(STFS_WRITE_BUFFER)
+  // a seek away from buffered data programs it
+  if(fildes<MAX_OPEN_FILES && vol->fdesc[fildes].wbuf_len>0) {
+    UNLOCK(vol);
+    WRITE_LOCK(vol);
+  }
+#endif // STFS_THREADS && STFS_WRITE_BUFFER
+  TRACE_BEGIN(vol, LSEEK, fildes, offset);
+  const off_t ret=seek_file(fildes, offset, whence, vol);
+  TRACE_END(vol, LSEEK, ret);
+  UNLOCK(vol);
+  return ret;
 }
 
-ssize_t stfs_write(uint32_t fildes, const void *buf, size_t nbyte, Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK]) {
-  // check if fildes is valid
-  // before writing a chunk check if it changed
-  // update inode if neccessary
-  if(nbyte<1) return 0;
-  if(buf==NULL) return 0;
-  VALIDFD(fildes)
-  if(fdesc[fildes].fptr+nbyte>MAX_FILE_SIZE) {
-    // fail too big
-    LOG(1, "[x] too big, %d\n", fdesc[fildes].fptr+nbyte);
-    errno = E_TOOBIG;
-    nbyte=MAX_FILE_SIZE-fdesc[fildes].fptr;
-  }
-
-  if(fdesc[fildes].fptr>fdesc[fildes].ichunk.inode.size) {
-    // due to lseek pointing behind eof there would be holes if we
-    // write to this position.
-    LOG(1, "[i] todo 0xff extend then append existing data\n");
-    LOG(1, "[x] only if seek allows it, but it won't\n");
-    errno = E_INVFP;
-    return -1;
-  }
+uint32_t stfs_size(uint32_t fildes, STFS_Volume *vol) {
+  VALIDFD(vol,fildes);
+  return vol->fdesc[fildes].ichunk.inode.size;
+}
 
+// writes nbyte at the file pointer into data chunks
+static ssize_t write_chunks(uint32_t fildes, const void *buf, size_t nbyte, STFS_Volume *vol) {
   uint32_t written=0;
-  if(fdesc[fildes].fptr<=fdesc[fildes].ichunk.inode.size) {
-    // append to end of file
-    uint32_t b,c;
-    Chunk chunk;
-    if(fdesc[fildes].fptr<fdesc[fildes].ichunk.inode.size) {
-      // we are overwriting some chunks, delete them all
-      // this is most important for the case that the fs is full
-      // then every chunk overwrite would trigger a full vacuum
-      uint32_t startseq=(fdesc[fildes].fptr)/DATA_PER_CHUNK;
-      uint32_t endseq=(fdesc[fildes].fptr+nbyte-1)/DATA_PER_CHUNK;
-      if(endseq>fdesc[fildes].ichunk.inode.size/DATA_PER_CHUNK)
-        endseq = fdesc[fildes].ichunk.inode.size/DATA_PER_CHUNK;
-      LOG(1,"[.] %d %d\n",startseq, endseq);
-      uint32_t i;
-      for(i=startseq;i<endseq;i++) {
-        b=c=0;
-        if(find_chunk(blocks, Data, fdesc[fildes].ichunk.inode.oid, 0, i, &b, &c)==NULL) {
-          continue;
-          // fail, couldn't find chunk
-          //LOG(1, "[x] couldn't find chunk to overwrite: %d\n", i);
-          //errno = E_NOCHUNK;
-          //return -1;
-        }
-        // todo: sacrificing performance check if the overwritten
-        // block changes in a way that needs deletion. otherwise we
-        // could skip deleting it.
-        del_chunk(blocks, b, c);
+  const uint32_t dpc=STFS_DATA_PER_CHUNK(vol);
+  uint32_t b,c;
+  Chunk chunk;
+  // chunks that existed before are overwritten, the rest are appended
+  const uint32_t oldchunks=(vol->fdesc[fildes].ichunk.inode.size+dpc-1)/dpc;
+  if(vol->fdesc[fildes].fptr<vol->fdesc[fildes].ichunk.inode.size) {
+    // we are overwriting some chunks, delete them all
+    // this is most important for the case that the fs is full
+    // then every chunk overwrite would trigger a full vacuum
+    // partially overwritten chunks at both ends are kept, their
+    // remaining bytes are merged below
+    uint32_t startseq=(vol->fdesc[fildes].fptr+dpc-1)/dpc;
+    uint32_t endseq=(vol->fdesc[fildes].fptr+nbyte-1)/dpc;
+    if(endseq>vol->fdesc[fildes].ichunk.inode.size/dpc)
+      endseq = vol->fdesc[fildes].ichunk.inode.size/dpc;
+    LOG(1,"[.] %d %d\n",startseq, endseq);
+    uint32_t i;
+    for(i=startseq;i<endseq;i++) {
+      if(find_data(vol, vol->fdesc[fildes].ichunk.inode.oid, i, &b, &c)==NULL) {
+        continue;
+        // fail, couldn't find chunk
+        //LOG(1, "[x] couldn't find chunk to overwrite: %d\n", i);
+        //errno = E_NOCHUNK;
+        //return -1;
       }
-      LOG(3,"[i] deleted %d chunks to be overwritten\n",endseq-startseq);
+      // todo: sacrificing performance check if the overwritten
+      // block changes in a way that needs deletion. otherwise we
+      // could skip deleting it.
+      del_chunk(vol, b, c);
     }
-    for(written=0;written<nbyte;) {
-      memset(&chunk,0xff,sizeof(chunk));
-      chunk.type=Data;
-      chunk.data.oid=fdesc[fildes].ichunk.inode.oid;
-      chunk.data.seq=(fdesc[fildes].fptr+written)/DATA_PER_CHUNK;
-
-      LOG(3,"[i] writing chunk %d\n", chunk.data.seq);
-      b=c=0;
-      const uint32_t towrite=((nbyte-written>DATA_PER_CHUNK-(fdesc[fildes].fptr+written)%DATA_PER_CHUNK)?
-                         DATA_PER_CHUNK-((fdesc[fildes].fptr+written)%DATA_PER_CHUNK):
-                         (nbyte-written));
-      if(find_chunk(blocks, Data, chunk.data.oid, 0, chunk.data.seq, &b, &c)!=NULL) {
-        // found chunk, check if write is necessary, if so partial, or full?
-        memcpy(chunk.data.data, &blocks[b][c].data.data, DATA_PER_CHUNK);
-        memcpy(chunk.data.data+((fdesc[fildes].fptr+written)%DATA_PER_CHUNK), ((uint8_t*) buf)+written,towrite);
-        uint32_t i;
-        // can we update the chunk, or have to del,create a new one?
-        for(i=0;i<sizeof(Chunk);i++) {
-          if((((uint8_t*) &blocks[b][c])[i] & ((uint8_t*) &chunk)[i]) != ((uint8_t*) &chunk)[i]) {
-            break;
-          }
-        }
-        if(i<sizeof(Chunk)) { // we have to create a new chunk
-          del_chunk(blocks, b, c);
-          //dump_chunk(&chunk);
-          if(store_chunk(blocks, &chunk)==-1) {
-            // fail to store chunk
-            LOG(1, "failed to store chunk\n");
-            goto exit;
-          }
-        } else { // we can update the chunk \o/
-          //dump_chunk(&chunk);
-          write_chunk(&blocks[b][c], &chunk, sizeof(chunk));
+    LOG(3,"[i] deleted %d chunks to be overwritten\n",endseq-startseq);
+  }
+  for(written=0;written<nbyte;) {
+    memset(&chunk,0xff,sizeof(chunk));
+    chunk.type=Data;
+    chunk.data.oid=vol->fdesc[fildes].ichunk.inode.oid;
+    chunk.data.seq=(vol->fdesc[fildes].fptr+written)/dpc;
+
+    LOG(3,"[i] writing chunk %d\n", chunk.data.seq);
+    const uint32_t stream=(chunk.data.seq<oldchunks)?STREAM_HOT:STREAM_COLD;
+    const uint32_t coff=(vol->fdesc[fildes].fptr+written)%dpc;
+    const uint32_t towrite=(nbyte-written>dpc-coff)?dpc-coff:(nbyte-written);
+    if(find_data(vol, chunk.data.oid, chunk.data.seq, &b, &c)!=NULL) {
+      // found chunk, check if write is necessary, if so partial, or full?
+      memcpy(chunk.data.data, CHUNK(vol,b,c)->data.data, dpc);
+      memcpy(chunk.data.data+coff, ((uint8_t*) buf)+written,towrite);
+      uint32_t i;
+      // can we update the chunk, or have to del,create a new one?
+      for(i=0;i<vol->chunk_size;i++) {
+        if((((uint8_t*) CHUNK(vol,b,c))[i] & ((uint8_t*) &chunk)[i]) != ((uint8_t*) &chunk)[i]) {
+          break;
         }
-        written+=towrite;
-      } else {
-        // prepare chunk for writing
-        memcpy(chunk.data.data, ((uint8_t*) buf)+written, (nbyte-written>DATA_PER_CHUNK)?DATA_PER_CHUNK:(nbyte-written));
+      }
+      if(i<vol->chunk_size || PINNED(vol,b)) { // we have to create a new chunk
+        del_chunk(vol, b, c);
         //dump_chunk(&chunk);
-        if(store_chunk(blocks, &chunk)==-1) {
+        if(store_chunk(vol, &chunk, stream)==-1) {
           // fail to store chunk
           LOG(1, "failed to store chunk\n");
           goto exit;
         }
-        written+=(nbyte-written>DATA_PER_CHUNK)?DATA_PER_CHUNK:(nbyte-written);
+      } else { // we can update the chunk \o/
+        COUNT(vol, in_place, 1);
+        NEW_GENERATION(vol);
+        //dump_chunk(&chunk);
+        write_chunk(vol, CHUNK(vol,b,c), &chunk);
+      }
+    } else {
+      // prepare chunk for writing
+      memcpy(chunk.data.data+coff, ((uint8_t*) buf)+written, towrite);
+      //dump_chunk(&chunk);
+      if(store_chunk(vol, &chunk, stream)==-1) {
+        // fail to store chunk
+        LOG(1, "failed to store chunk\n");
+        goto exit;
       }
     }
+    written+=towrite;
   }
  exit:
   // update inode
-  if(written+fdesc[fildes].fptr>fdesc[fildes].ichunk.inode.size) {
+  if(written+vol->fdesc[fildes].fptr>vol->fdesc[fildes].ichunk.inode.size) {
     // file grows update inode
-    fdesc[fildes].ichunk.inode.size=written+fdesc[fildes].fptr;
+    vol->fdesc[fildes].ichunk.inode.size=written+vol->fdesc[fildes].fptr;
   }
   if(written>0) {
-    fdesc[fildes].idirty=1;
+    vol->fdesc[fildes].idirty=1;
   }
 
-  fdesc[fildes].fptr+=written;
+  vol->fdesc[fildes].fptr+=written;
 
   return written;
 }
 
-ssize_t stfs_read(uint32_t fildes, void *buf, size_t nbyte, Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK]) {
+// moves the content of an inline file into data chunks
+static int move_inline_data(uint32_t fildes, STFS_Volume *vol) {
+  Inode_t *inode=&vol->fdesc[fildes].ichunk.inode;
+  uint8_t data[INLINE_DATA_SIZE];
+  const uint32_t size=inode->size, fptr=vol->fdesc[fildes].fptr;
+  memcpy(data, inode->data, sizeof(data));
+  memset(inode->data, 0xff, sizeof(inode->data));
+  inode->external=1;
+  inode->size=0;
+  vol->fdesc[fildes].fptr=0;
+  if(write_chunks(fildes, data, size, vol)!=size) {
+    // fail, stay inline
+    LOG(1, "[x] failed to move inline data of %x\n", inode->oid);
+    del_chunks(vol, inode->oid, 0);
+    memcpy(inode->data, data, sizeof(data));
+    inode->external=0;
+    inode->size=size;
+    vol->fdesc[fildes].fptr=fptr;
+    return -1;
+  }
+  vol->fdesc[fildes].fptr=fptr;
+  return 0;
+}
+
+#ifdef STFS_WRITE_BUFFER
+// programs the bytes collected in the write buffer of fildes
+static int flush_wbuf(uint32_t fildes, STFS_Volume *vol) {
+  STFS_File *f=&vol->fdesc[fildes];
+  if(f->wbuf_len==0) return 0;
+  const uint32_t fptr=f->fptr, len=f->wbuf_len;
+  f->wbuf_len=0;
+  f->fptr=f->wbuf_pos;
+  // write_chunks tells appended from overwritten chunks by the size,
+  // so it gets the size from before the buffered writes. it grows it
+  // again as far as the write gets.
+  f->ichunk.inode.size=f->wbuf_size;
+  const ssize_t written=write_chunks(fildes, f->wbuf, len, vol);
+  f->fptr=fptr;
+  if(written!=len) {
+    LOG(1, "[x] failed to flush write buffer of fd %d\n", fildes);
+    if(f->fptr>f->ichunk.inode.size) f->fptr=f->ichunk.inode.size;
+    return -1;
+  }
+  return 0;
+}
+
+// collects small sequential writes in the write buffer, which is
+// programmed once the chunk it covers is complete. whole chunks are
+// written directly.
+static ssize_t buffer_write(uint32_t fildes, const void *buf, size_t nbyte, STFS_Volume *vol) {
+  STFS_File *f=&vol->fdesc[fildes];
+  const uint32_t dpc=STFS_DATA_PER_CHUNK(vol);
+  const uint32_t start=f->fptr;
+  uint32_t written=0;
+  while(written<nbyte) {
+    if(f->wbuf_len>0 && f->wbuf_pos+f->wbuf_len!=f->fptr) {
+      // not continuing the buffered write
+      if(flush_wbuf(fildes, vol)==-1) goto fail;
+    }
+    const uint32_t coff=f->fptr%dpc;
+    if(f->wbuf_len==0 && coff==0 && nbyte-written>=dpc) {
+      const uint32_t full=((nbyte-written)/dpc)*dpc;
+      const ssize_t ret=write_chunks(fildes, ((uint8_t*) buf)+written, full, vol);
+      if(ret>0) written+=ret;
+      if(ret!=full) goto fail;
+      continue;
+    }
+    const uint32_t n=(nbyte-written>dpc-coff)?dpc-coff:(nbyte-written);
+    if(f->wbuf_len==0) {
+      f->wbuf_pos=f->fptr;
+      f->wbuf_size=f->ichunk.inode.size;
+    }
+    memcpy(f->wbuf+f->wbuf_len, ((uint8_t*) buf)+written, n);
+    f->wbuf_len+=n;
+    f->fptr+=n;
+    written+=n;
+    if(f->fptr>f->ichunk.inode.size) f->ichunk.inode.size=f->fptr;
+    f->idirty=1;
+    if(coff+n==dpc) {
+      // chunk complete
+      if(flush_wbuf(fildes, vol)==-1) goto fail;
+    }
+  }
+  return written;
+ fail:
+  return (f->fptr>start)?f->fptr-start:-1;
+}
+#endif // STFS_WRITE_BUFFER
+
+static ssize_t write_file(uint32_t fildes, const void *buf, size_t nbyte, STFS_Volume *vol) {
+  // check if fildes is valid
+  // before writing a chunk check if it changed
+  // update inode if neccessary
+  if(nbyte<1) return 0;
+  if(buf==NULL) return 0;
+  VALIDFD(vol,fildes)
+  if(vol->fdesc[fildes].fptr+nbyte>MAX_FILE_SIZE) {
+    // fail too big
+    LOG(1, "[x] too big, %d\n", vol->fdesc[fildes].fptr+nbyte);
+    ERR(vol) = E_TOOBIG;
+    nbyte=MAX_FILE_SIZE-vol->fdesc[fildes].fptr;
+  }
+
+  if(vol->fdesc[fildes].fptr>vol->fdesc[fildes].ichunk.inode.size) {
+    // due to lseek pointing behind eof there would be holes if we
+    // write to this position.
+    LOG(1, "[i] todo 0xff extend then append existing data\n");
+    LOG(1, "[x] only if seek allows it, but it won't\n");
+    ERR(vol) = E_INVFP;
+    return -1;
+  }
+
+  if(vol->fdesc[fildes].ichunk.inode.external==0) {
+    if(vol->fdesc[fildes].fptr+nbyte<=STFS_INLINE_DATA_SIZE(vol)) {
+      // file stays small enough, update the inline content
+      NEW_GENERATION(vol);
+      memcpy(vol->fdesc[fildes].ichunk.inode.data+vol->fdesc[fildes].fptr, buf, nbyte);
+      vol->fdesc[fildes].fptr+=nbyte;
+      if(vol->fdesc[fildes].fptr>vol->fdesc[fildes].ichunk.inode.size) {
+        vol->fdesc[fildes].ichunk.inode.size=vol->fdesc[fildes].fptr;
+      }
+      if(nbyte>0) vol->fdesc[fildes].idirty=1;
+      return nbyte;
+    }
+    // file grows too big to be inline
+    if(move_inline_data(fildes, vol)==-1) {
+      return -1;
+    }
+  }
+
+#ifdef STFS_WRITE_BUFFER
+  return buffer_write(fildes, buf, nbyte, vol);
+#else
+  return write_chunks(fildes, buf, nbyte, vol);
+#endif // STFS_WRITE_BUFFER
+}
+
+ssize_t stfs_write(uint32_t fildes, const void *buf, size_t nbyte, STFS_Volume *vol) {
+  WRITE_LOCK(vol);
+  TRACE_BEGIN(vol, WRITE, fildes, nbyte);
+  const ssize_t ret=write_file(fildes, buf, nbyte, vol);
+  TRACE_END(vol, WRITE, ret);
+  UNLOCK(vol);
+  return ret;
+}
+
+static int sync_file(uint32_t fildes, STFS_Volume *vol) {
+  VALIDFD(vol,fildes)
+#ifdef STFS_WRITE_BUFFER
+  return flush_wbuf(fildes, vol);
+#else
+  return 0;
+#endif // STFS_WRITE_BUFFER
+}
+
+int stfs_fsync(uint32_t fildes, STFS_Volume *vol) {
+  WRITE_LOCK(vol);
+  TRACE_BEGIN(vol, FSYNC, fildes, 0);
+  const int ret=sync_file(fildes, vol);
+  TRACE_END(vol, FSYNC, ret);
+  UNLOCK(vol);
+  return ret;
+}
+
+static ssize_t read_file(uint32_t fildes, void *buf, size_t nbyte, STFS_Volume *vol) {
   if(nbyte<1) return 0;
   if(buf==NULL) return 0;
-  VALIDFD(fildes)
+  VALIDFD(vol,fildes)
+  const uint32_t dpc=STFS_DATA_PER_CHUNK(vol);
   uint32_t read=0;
   uint32_t b,c;
-  if(nbyte+fdesc[fildes].fptr>fdesc[fildes].ichunk.inode.size) {
+  if(nbyte+vol->fdesc[fildes].fptr>vol->fdesc[fildes].ichunk.inode.size) {
     // read only as much there is available, not beyond eof
-    nbyte=fdesc[fildes].ichunk.inode.size-fdesc[fildes].fptr;
-    LOG(3, "[i] changed nbyte to %d, size is %d\n",nbyte, fdesc[fildes].ichunk.inode.size);
+    nbyte=vol->fdesc[fildes].ichunk.inode.size-vol->fdesc[fildes].fptr;
+    LOG(3, "[i] changed nbyte to %d, size is %d\n",nbyte, vol->fdesc[fildes].ichunk.inode.size);
+  }
+  if(vol->fdesc[fildes].ichunk.inode.external==0) {
+    memcpy(buf, vol->fdesc[fildes].ichunk.inode.data+vol->fdesc[fildes].fptr, nbyte);
+    vol->fdesc[fildes].fptr+=nbyte;
+    return nbyte;
   }
   for(read=0;read<nbyte;) {
     uint32_t seq;
-    const Chunk *chunk;
-    seq=(fdesc[fildes].fptr+read)/DATA_PER_CHUNK;
-    b=c=0;
-    const uint32_t oid=fdesc[fildes].ichunk.inode.oid;
-    if((chunk=find_chunk(blocks, Data, oid, 0, seq, &b, &c))!=NULL) {
+    const uint8_t *data;
+    seq=(vol->fdesc[fildes].fptr+read)/dpc;
+    const uint32_t oid=vol->fdesc[fildes].ichunk.inode.oid;
+    const Chunk *chunk=find_data(vol, oid, seq, &b, &c);
+#ifdef STFS_WRITE_BUFFER
+    uint8_t merged[DATA_PER_CHUNK];
+    const STFS_File *f=&vol->fdesc[fildes];
+    if(f->wbuf_len>0 && seq==f->wbuf_pos/dpc) {
+      // overlay the not yet programmed bytes over the chunk
+      if(chunk!=NULL) memcpy(merged, chunk->data.data, dpc);
+      else memset(merged, 0xff, dpc);
+      memcpy(merged+f->wbuf_pos%dpc, f->wbuf, f->wbuf_len);
+      data=merged;
+    } else
+#endif // STFS_WRITE_BUFFER
+    if(chunk!=NULL) {
       //printf("[i] found chunk %d\n",seq);
-      uint32_t coff=(fdesc[fildes].fptr+read)%DATA_PER_CHUNK;
-      //printf("[i] coff %d\n", coff);
-      memcpy(((uint8_t*) buf)+read, chunk->data.data+coff, ((nbyte-read>DATA_PER_CHUNK)?(DATA_PER_CHUNK-coff):(nbyte-read)));
-      read+=((nbyte-read>(DATA_PER_CHUNK-coff))?(DATA_PER_CHUNK-coff):(nbyte-read));
+      data=chunk->data.data;
     } else {
-      errno = E_NOCHUNK;
+      ERR(vol) = E_NOCHUNK;
       return -1;
     }
+    uint32_t coff=(vol->fdesc[fildes].fptr+read)%dpc;
+    //printf("[i] coff %d\n", coff);
+    const uint32_t n=(nbyte-read>dpc-coff)?dpc-coff:(nbyte-read);
+    memcpy(((uint8_t*) buf)+read, data+coff, n);
+    read+=n;
   }
-  fdesc[fildes].fptr+=read;
+  vol->fdesc[fildes].fptr+=read;
   return read;
 }
 
-static void del_chunks(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint32_t oid) {
-  uint32_t b=0,c=0, n=0;
-  const Chunk *chunk=find_chunk(blocks, Data, oid, 0, 0xffff, &b, &c);
-  while(chunk) {
-    del_chunk(blocks, b, c);
-    b=c=0;
-    chunk=find_chunk(blocks, Data, oid, 0,0xffff, &b, &c);
-    n++;
+ssize_t stfs_read(uint32_t fildes, void *buf, size_t nbyte, STFS_Volume *vol) {
+  READ_LOCK(vol);
+  TRACE_BEGIN(vol, READ, fildes, nbyte);
+  const ssize_t ret=read_file(fildes, buf, nbyte, vol);
+  TRACE_END(vol, READ, ret);
+  UNLOCK(vol);
+  return ret;
+}
+
+// like read_file, but instead of copying the bytes fills segs with
+// where they are, at most *nsegs of them, and sets *nsegs to the
+// number filled.
+static ssize_t read_iov(uint32_t fildes, STFS_Segment *segs, uint32_t *nsegs, size_t nbyte, STFS_Volume *vol) {
+  if(nsegs==NULL) return 0;
+  const uint32_t max=*nsegs;
+  *nsegs=0;
+  if(nbyte<1 || segs==NULL || max==0) return 0;
+  VALIDFD(vol,fildes)
+#ifdef STFS_WRITE_BUFFER
+  // segments can only point to what is programmed
+  if(flush_wbuf(fildes, vol)!=0) return -1;
+#endif // STFS_WRITE_BUFFER
+  const uint32_t dpc=STFS_DATA_PER_CHUNK(vol);
+  STFS_File *f=&vol->fdesc[fildes];
+  uint32_t read, b, c;
+  if(nbyte+f->fptr>f->ichunk.inode.size) {
+    // read only as much there is available, not beyond eof
+    nbyte=f->ichunk.inode.size-f->fptr;
   }
-  LOG(3,"[i] deleted %d chunks from oid %x\n",n, oid);
+  if(f->ichunk.inode.external==0) {
+    if(nbyte>0) {
+      segs[0].data=f->ichunk.inode.data+f->fptr;
+      segs[0].len=nbyte;
+      *nsegs=1;
+    }
+    f->fptr+=nbyte;
+    return nbyte;
+  }
+  for(read=0;read<nbyte && *nsegs<max;) {
+    const Chunk *chunk=find_data(vol, f->ichunk.inode.oid, (f->fptr+read)/dpc, &b, &c);
+    if(chunk==NULL) {
+      ERR(vol) = E_NOCHUNK;
+      return -1;
+    }
+    const uint32_t coff=(f->fptr+read)%dpc;
+    const uint32_t n=(nbyte-read>dpc-coff)?dpc-coff:(nbyte-read);
+    segs[*nsegs].data=chunk->data.data+coff;
+    segs[*nsegs].len=n;
+    (*nsegs)++;
+    read+=n;
+  }
+  f->fptr+=read;
+  return read;
+}
+
+// reads up to nbyte like stfs_read, without copying: segs are filled
+// with pointers into the mapped flash (into the descriptor for files
+// stored inline), one per chunk, until nbyte are covered or *nsegs are
+// used. they stay valid as long as stfs_generation() returns what it
+// did before the call: without STFS_THREADS until the next call that
+// modifies the volume, with STFS_THREADS compare it before and after
+// using them and retry on a change.
+ssize_t stfs_read_iov(uint32_t fildes, STFS_Segment *segs, uint32_t *nsegs, size_t nbyte, STFS_Volume *vol) {
+  READ_LOCK(vol);
+#if defined(STFS_THREADS) && defined(STFS_WRITE_BUFFER)
+  // buffered data has to be programmed first
+  if(fildes<MAX_OPEN_FILES && vol->fdesc[fildes].wbuf_len>0) {
+    UNLOCK(vol);
+    WRITE_LOCK(vol);
+  }
+#endif // STFS_THREADS && STFS_WRITE_BUFFER
+  TRACE_BEGIN(vol, READ_IOV, fildes, nbyte);
+  const ssize_t ret=read_iov(fildes, segs, nsegs, nbyte, vol);
+  TRACE_END(vol, READ_IOV, ret);
+  UNLOCK(vol);
+  return ret;
 }
 
-int stfs_close(uint32_t fildes, Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK]) {
-  VALIDFD(fildes)
+// changes whenever segments returned by stfs_read_iov() may have
+// become invalid, takes no lock
+uint32_t stfs_generation(STFS_Volume *vol) {
+  return GENERATION(vol);
+}
 
-  if(fdesc[fildes].idirty!=0) {
+#if STFS_SNAPSHOTS > 0
+static int take_snapshot(STFS_Volume *vol, uint8_t *path, STFS_Snapshot *snap,
+                         STFS_ChunkRef *refs, uint32_t nrefs) {
+  const uint32_t dpc=STFS_DATA_PER_CHUNK(vol);
+  uint32_t b=0, c=0, seq;
+  const uint32_t self=oid_by_path(vol, path, &b, &c);
+  if(self==0) {
+    // fail no such file
+    ERR(vol) = E_NOTFOUND;
+    return -1;
+  }
+  if(self==1 || CHUNK(vol,b,c)->inode.type!=File) {
+    LOG(1, "[x] path '%s' is not a File\n", path);
+    ERR(vol) = E_WRONGOBJ;
+    return -1;
+  }
+  const Inode_t *inode=&CHUNK(vol,b,c)->inode;
+  const uint32_t n=inode->external?(inode_size(vol, inode)+dpc-1)/dpc:0;
+  if(n>nrefs) {
+    // fail refs cannot hold all chunks of the file
+    ERR(vol) = E_TOOBIG;
+    return -1;
+  }
+  load_inode(vol, &snap->inode, inode);
+  memset(snap->pinned, 0, sizeof(snap->pinned));
+  for(seq=0;seq<n;seq++) {
+    if(find_data(vol, snap->inode.oid, seq, &b, &c)==NULL) {
+      refs[seq]=NO_CHUNK;
+      continue;
+    }
+    refs[seq]=CHUNK_REF(vol,b,c);
+    if((snap->pinned[b/8] & (1<<(b%8)))==0) {
+      snap->pinned[b/8]|=1<<(b%8);
+      PIN(vol,b);
+    }
+  }
+  snap->vol=vol;
+  snap->refs=refs;
+  return 0;
+}
+
+// records where the chunks of the file at path are and pins their
+// blocks. until stfs_snapshot_release() the chunks are neither
+// changed nor erased, so the snapshot reads them without taking any
+// lock. a pinned block that is vacuumed stays retired until then, the
+// writer fails with E_FULL if it needs it back earlier.
+int stfs_snapshot(STFS_Volume *vol, uint8_t *path, STFS_Snapshot *snap, STFS_ChunkRef *refs, uint32_t nrefs) {
+  READ_LOCK(vol);
+  TRACE_BEGIN(vol, SNAPSHOT, 0, 0);
+  const int ret=take_snapshot(vol, path, snap, refs, nrefs);
+  TRACE_END(vol, SNAPSHOT, ret);
+  UNLOCK(vol);
+  return ret;
+}
+
+// reads like pread, any number of threads may read one snapshot
+ssize_t stfs_snapshot_read(STFS_Snapshot *snap, uint32_t offset, void *buf, size_t nbyte) {
+  STFS_Volume *vol=snap->vol;
+  const uint32_t dpc=STFS_DATA_PER_CHUNK(vol);
+  uint32_t read;
+  if(offset>=snap->inode.size) return 0;
+  if(nbyte>snap->inode.size-offset) nbyte=snap->inode.size-offset;
+  if(snap->inode.external==0) {
+    memcpy(buf, snap->inode.data+offset, nbyte);
+    return nbyte;
+  }
+  for(read=0;read<nbyte;) {
+    const STFS_ChunkRef ref=snap->refs[(offset+read)/dpc];
+    if(ref==NO_CHUNK) {
+      ERR(vol) = E_NOCHUNK;
+      return -1;
+    }
+    const uint32_t coff=(offset+read)%dpc;
+    const uint32_t n=(nbyte-read>dpc-coff)?dpc-coff:(nbyte-read);
+    memcpy(((uint8_t*) buf)+read, CHUNK_AT(vol,ref)->data.data+coff, n);
+    read+=n;
+  }
+  return read;
+}
+
+// unpins the blocks, one retired for the snapshot is erased on the
+// next vacuum
+void stfs_snapshot_release(STFS_Snapshot *snap) {
+  uint32_t b;
+  for(b=0;b<snap->vol->nblocks;b++) {
+    if(snap->pinned[b/8] & (1<<(b%8))) UNPIN(snap->vol,b);
+  }
+}
+#endif // STFS_SNAPSHOTS
+
+static int close_file(uint32_t fildes, STFS_Volume *vol) {
+  VALIDFD(vol,fildes)
+#ifdef STFS_WRITE_BUFFER
+  // on failure the inode still records what made it to flash
+  flush_wbuf(fildes, vol);
+#endif // STFS_WRITE_BUFFER
+
+  if(vol->fdesc[fildes].idirty!=0) {
     // check if path is valid
     uint32_t b=0,c=0;
     const Chunk *chunk;
-    if(fdesc[fildes].ichunk.inode.parent!=1) {
-      chunk=find_chunk(blocks, Inode, fdesc[fildes].ichunk.inode.parent, 0,0, &b, &c);
+    if(vol->fdesc[fildes].ichunk.inode.parent!=1) {
+      chunk=find_chunk(vol, Inode, vol->fdesc[fildes].ichunk.inode.parent, 0,0, &b, &c);
       while(chunk && chunk->inode.parent!=1) {
         b=c=0;
-        chunk=find_chunk(blocks, Inode, chunk->inode.parent, 0,0, &b, &c);
+        chunk=find_chunk(vol, Inode, chunk->inode.parent, 0,0, &b, &c);
       }
       if(!chunk) {
         LOG(1, "[x] null chunk while resolving path\n");
-        del_chunks(blocks, fdesc[fildes].ichunk.inode.oid);
-        errno = E_DANGLE;
+        del_chunks(vol, vol->fdesc[fildes].ichunk.inode.oid, 0);
+        ERR(vol) = E_DANGLE;
         return -1;
       }
       if(chunk->inode.type!=0) {
         LOG(1, "[x] invalid path\n");
-        del_chunks(blocks, fdesc[fildes].ichunk.inode.oid);
-        errno = E_DANGLE;
+        del_chunks(vol, vol->fdesc[fildes].ichunk.inode.oid, 0);
+        ERR(vol) = E_DANGLE;
         return -1;
       }
       if(chunk->inode.parent!=1) {
         LOG(1, "[x] while resolving path\n");
-        del_chunks(blocks, fdesc[fildes].ichunk.inode.oid);
-        errno = E_DANGLE;
+        del_chunks(vol, vol->fdesc[fildes].ichunk.inode.oid, 0);
+        ERR(vol) = E_DANGLE;
         return -1;
       }
     }
     // need to update inode chunk
     //LOG(3, "[i] tentatively updating inode\n");
     b=c=0;
-    chunk=find_chunk(blocks, Inode, fdesc[fildes].ichunk.inode.oid, 0,0, &b, &c);
+    chunk=find_chunk(vol, Inode, vol->fdesc[fildes].ichunk.inode.oid, 0,0, &b, &c);
     if(chunk==NULL || chunk->inode.type!=File) { // if inode is dir, then file
                                                  // has been unlinked and a dir instead created
                                                  // between open and close
       // inode has been deleted, also delete all chunks
-      del_chunks(blocks, fdesc[fildes].ichunk.inode.oid);
-    } else if(memcmp(chunk,&fdesc[fildes].ichunk, sizeof(*chunk))!=0) {
-      // invalidate old chunk
-      LOG(3, "[i] deleting old inode at %d %d\n", b, c);
-      del_chunk(blocks, b, c);
-      // write new chunk
-      store_chunk(blocks, &fdesc[fildes].ichunk);
+      del_chunks(vol, vol->fdesc[fildes].ichunk.inode.oid, 0);
+    } else {
+      Chunk stored;
+      stored.type=Inode;
+      load_inode(vol, &stored.inode, &chunk->inode);
+      if(memcmp(&stored, &vol->fdesc[fildes].ichunk, vol->chunk_size)!=0 &&
+         journal_size(vol, b, c, &stored, &vol->fdesc[fildes].ichunk)!=0) {
+        // invalidate old chunk
+        LOG(3, "[i] deleting old inode at %d %d\n", b, c);
+        del_chunk(vol, b, c);
+        // write new chunk
+        store_chunk(vol, &vol->fdesc[fildes].ichunk, STREAM_META);
+      }
     }
   }
 
-  fdesc[fildes].free=1;
-  fdesc[fildes].idirty=0;
-  fdesc[fildes].fptr=0;
+  // segments of an inline file point into the descriptor
+  NEW_GENERATION(vol);
+  vol->fdesc[fildes].free=1;
+  vol->fdesc[fildes].idirty=0;
+  vol->fdesc[fildes].fptr=0;
 
   return 0;
 }
 
-int stfs_unlink(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *path) {
+int stfs_close(uint32_t fildes, STFS_Volume *vol) {
+  READ_LOCK(vol);
+#ifdef STFS_THREADS
+  // a descriptor that changed nothing is released alongside readers,
+  // else its inode and buffered data have to be stored
+  if(fildes<MAX_OPEN_FILES && (vol->fdesc[fildes].idirty!=0
+#ifdef STFS_WRITE_BUFFER
+                               || vol->fdesc[fildes].wbuf_len>0
+#endif // STFS_WRITE_BUFFER
+                               )) {
+    UNLOCK(vol);
+    WRITE_LOCK(vol);
+  }
+#endif // STFS_THREADS
+  TRACE_BEGIN(vol, CLOSE, fildes, 0);
+  const int ret=close_file(fildes, vol);
+  TRACE_END(vol, CLOSE, ret);
+  UNLOCK(vol);
+  return ret;
+}
+
+static int unlink_file(STFS_Volume *vol, uint8_t *path) {
   uint32_t b=0, c=0;
-  const uint32_t self=oid_by_path(blocks, path, &b, &c);
+  const uint32_t self=oid_by_path(vol, path, &b, &c);
   if(self==0) {
     LOG(1, "[x] path doesn't exist '%s'\n", path);
     // fail no such file
-    errno = E_NOTFOUND;
+    ERR(vol) = E_NOTFOUND;
     return -1;
   }
-  if(self==1 || blocks[b][c].inode.type!=File) {
+  if(self==1 || CHUNK(vol,b,c)->inode.type!=File) {
     LOG(1, "[x] cannot unlink directory '%s'\n", path);
-    errno = E_OPEN;
+    ERR(vol) = E_OPEN;
     // fail no such file
     return -1;
   }
   // check if self is indeed a file
-  if(blocks[b][c].type==Inode && blocks[b][c].inode.type!=File) {
+  if(CHUNK(vol,b,c)->type==Inode && CHUNK(vol,b,c)->inode.type!=File) {
     // fail
     LOG(1, "[x] path '%s' is not a File\n", path);
-    errno = E_WRONGOBJ;
+    ERR(vol) = E_WRONGOBJ;
     return -1;
   }
 
-  uint32_t oid=blocks[b][c].inode.oid;
+  const uint32_t oid=CHUNK(vol,b,c)->inode.oid;
+  const uint32_t external=CHUNK(vol,b,c)->inode.external;
 
   // del inode chunk
   LOG(3, "[i] deleting inode chunk %d %d\n", b,c);
-  del_chunk(blocks, b, c);
+  del_chunk(vol, b, c);
 
   // del data chunks
-  const Chunk*chunk;
-  b=c=0;
-  while((chunk=find_chunk(blocks, Data, oid, 0, 0xffff, &b, &c))!=NULL) {
-    LOG(3, "[i] deleting data chunk %d %d\n", b,c);
-    del_chunk(blocks, b, c);
-  }
+  if(external) del_chunks(vol, oid, 0);
   return 0;
 }
 
-int stfs_truncate(uint8_t *path, uint32_t length, Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK]) {
+int stfs_unlink(STFS_Volume *vol, uint8_t *path) {
+  WRITE_LOCK(vol);
+  TRACE_BEGIN(vol, UNLINK, 0, 0);
+  const int ret=unlink_file(vol, path);
+  TRACE_END(vol, UNLINK, ret);
+  UNLOCK(vol);
+  return ret;
+}
+
+static int truncate_file(uint8_t *path, uint32_t length, STFS_Volume *vol) {
   LOG(2, "[i] truncating '%s' to %d\n", path, length);
   uint32_t b=0, c=0;
-  const uint32_t self=oid_by_path(blocks, path, &b, &c);
+  const uint32_t dpc=STFS_DATA_PER_CHUNK(vol);
+  const uint32_t self=oid_by_path(vol, path, &b, &c);
   if(self==0) {
     LOG(1, "[x] path doesn't exist '%s'\n", path);
     // fail no such file
-    errno = E_NOTFOUND;
+    ERR(vol) = E_NOTFOUND;
     return -1;
   }
-  if(self==1 || blocks[b][c].inode.type!=File) {
+  if(self==1 || CHUNK(vol,b,c)->inode.type!=File) {
     LOG(1, "[x] cannot truncate directory '%s'\n", path);
-    errno = E_OPEN;
+    ERR(vol) = E_OPEN;
     // fail no such file
     return -1;
   }
   // check if self is indeed a file
-  if(blocks[b][c].type==Inode && blocks[b][c].inode.type!=File) {
+  if(CHUNK(vol,b,c)->type==Inode && CHUNK(vol,b,c)->inode.type!=File) {
     // fail
     LOG(1, "[x] path '%s' is not a File\n", path);
-    errno = E_WRONGOBJ;
+    ERR(vol) = E_WRONGOBJ;
     return -1;
   }
-  if(blocks[b][c].inode.size<=length) {
+  if(inode_size(vol, &CHUNK(vol,b,c)->inode)<=length) {
     // fail
     LOG(1, "[x] path '%s' is too short\n", path);
-    errno = E_NOEXT;
+    ERR(vol) = E_NOEXT;
     return -1;
   }
 
-  // store new inode
   Chunk nchunk;
-  memcpy(&nchunk, &blocks[b][c], sizeof(Chunk));
+  nchunk.type=Inode;
+  load_inode(vol, &nchunk.inode, &CHUNK(vol,b,c)->inode);
   nchunk.inode.size=length;
-  store_chunk(blocks, &nchunk);
+  if(nchunk.inode.external==0) {
+    memset(nchunk.inode.data+length, 0xff, STFS_INLINE_DATA_SIZE(vol)-length);
+  }
 
-  uint32_t oid=blocks[b][c].inode.oid;
+  const uint32_t oid=CHUNK(vol,b,c)->inode.oid;
+  const Chunk*chunk;
 
-  // del inode chunk
-  LOG(3, "[i] deleting inode chunk %d %d\n", b,c);
-  del_chunk(blocks, b, c);
+  // store the new inode before deleting the old one, so the file
+  // survives a failure in between. storing might vacuum and move the
+  // old inode, it is found again by its oid.
+  if(store_chunk(vol, &nchunk, STREAM_META)!=0) return -1;
+  for(b=c=0;(chunk=find_chunk(vol, Inode, oid, 0, 0, &b, &c))!=NULL;c++) {
+    if(memcmp(chunk, &nchunk, vol->chunk_size)==0) continue;
+    LOG(3, "[i] deleting inode chunk %d %d\n", b,c);
+    del_chunk(vol, b, c);
+  }
+  if(nchunk.inode.external==0) return 0;
 
   // del data chunks
-  const Chunk*chunk;
-  uint32_t seq=length/DATA_PER_CHUNK;
-  if(length%DATA_PER_CHUNK>0) {
+  int ret=0;
+  uint32_t seq=length/dpc;
+  if(length%dpc>0) {
     Chunk dchunk;
-    b=c=0;
-    if((chunk=find_chunk(blocks, Data, oid, 0, seq++, &b, &c))==NULL) {
+    if((chunk=find_data(vol, oid, seq, &b, &c))==NULL) {
       LOG(1, "[x] no chunk to truncate from found\n");
-      errno = E_NOCHUNK;
+      ERR(vol) = E_NOCHUNK;
       return -1;
     }
-    memcpy(&dchunk, &blocks[b][c], sizeof(Chunk));
-    memset(&dchunk.data.data[length%DATA_PER_CHUNK], 0xff, (DATA_PER_CHUNK-length%DATA_PER_CHUNK));
-    del_chunk(blocks, b, c);
-    store_chunk(blocks, &dchunk);
-  }
-  b=c=0;
-  while((chunk=find_chunk(blocks, Data, oid, 0, seq++, &b, &c))!=NULL) {
-    LOG(3, "[i] deleting data chunk %d %d\n", b,c);
-    del_chunk(blocks, b, c);
-    b=c=0;
+    memcpy(&dchunk, chunk, vol->chunk_size);
+    memset(&dchunk.data.data[length%dpc], 0xff, (dpc-length%dpc));
+    if(memcmp(&dchunk, chunk, vol->chunk_size)!=0) {
+      // same as the inode, the old chunk goes once the new one is stored.
+      // if that fails the old one stays, its bytes past the new end are
+      // never read.
+      if(store_chunk(vol, &dchunk, STREAM_HOT)!=0) {
+        ret=-1;
+      } else {
+        for(b=c=0;(chunk=find_chunk(vol, Data, oid, 0, seq, &b, &c))!=NULL;c++) {
+          if(memcmp(chunk, &dchunk, vol->chunk_size)!=0) del_chunk(vol, b, c);
+        }
+      }
+    }
+    seq++;
   }
-  return 0;
+  del_chunks(vol, oid, seq);
+  return ret;
 }
 
-int stfs_init(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK]) {
-  // check if at least one block is empty for migration
-  uint32_t b, free, rcan, i;
-  for(b=0,free=0;b<NBLOCKS;b++) {
-    if(blocks[b][0].type==Empty) free++;
+int stfs_truncate(uint8_t *path, uint32_t length, STFS_Volume *vol) {
+  WRITE_LOCK(vol);
+  TRACE_BEGIN(vol, TRUNCATE, 0, length);
+  const int ret=truncate_file(path, length, vol);
+  TRACE_END(vol, TRUNCATE, ret);
+  UNLOCK(vol);
+  return ret;
+}
+
+// a vacuum interrupted by a remount leaves no block empty, its
+// destination is partly filled and its victim holds the chunks not
+// copied yet (a block retired for snapshots holds none). of all pairs
+// of blocks where the live chunks of one fit into the empty chunks of
+// the other, the one with the fewest to copy is vacuumed, which the
+// interrupted pair guarantees to exist. the victim becomes the
+// reserved block.
+static int mount_vacuum(STFS_Volume *vol) {
+  uint32_t src, dest, best_src=NBLOCKS, best_dest=NBLOCKS;
+  for(src=0;src<vol->nblocks;src++) {
+    for(dest=0;dest<vol->nblocks;dest++) {
+      if(dest==src || vol->live_chunks[src]>vol->chunks_per_block-vol->frontier[dest]) continue;
+      if(best_src>=NBLOCKS || vol->live_chunks[src]<vol->live_chunks[best_src]) {
+        best_src=src;
+        best_dest=dest;
+      }
+    }
   }
-  if(free==0) {
-    // fail no empty blocks
+  if(best_src>=NBLOCKS) return -1;
+  LOG(2, "[i] mount vacuums %d into %d\n", best_src, best_dest);
+  vol->reserved_block=best_dest;
+  if(vacuum_start(vol, best_src)!=0) return -1;
+  // in steps, so each copy is deleted at its source right away and
+  // another interruption leaves the same situation
+  while(vacuum_run(vol, vol->chunks_per_block-1)!=0);
+  return 0;
+}
+
+int stfs_mount(STFS_Volume *vol, const STFS_Backend *flash, STFS_MountInfo *info) {
+  // rebuild all runtime state in one pass, each block is read up to
+  // its first empty chunk
+  uint32_t b, free, rcan, i, visited=0;
+  uint32_t oid_max=OID_FIRST-1;
+#ifdef STFS_THREADS
+  // no other call may run on the volume while it is mounted. the
+  // locks are initialised once, initialising them again is undefined
+  if(!vol->locks_init) {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    // glibc prefers readers by default, a steady stream of them would
+    // starve the writer
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&vol->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&vol->cache_lock, NULL);
+    vol->locks_init=1;
+  }
+#endif // STFS_THREADS
+  if(vol->chunk_size<MIN_CHUNK_SIZE || vol->chunk_size>CHUNK_SIZE ||
+     vol->chunks_per_block<2 || vol->chunks_per_block>CHUNKS_PER_BLOCK ||
+     vol->nblocks<2 || vol->nblocks>NBLOCKS) {
+    // fail, geometry does not fit the RAM state
+    LOG(1, "[x] unsupported geometry %dB x %d x %d\n", vol->chunk_size, vol->chunks_per_block, vol->nblocks);
+    ERR(vol) = E_GEOMETRY;
     return -1;
   }
-  rcan=random()%free;
-  for(b=0,i=0;b<NBLOCKS;b++) {
-    if(blocks[b][0].type==Empty) {
-      if(i++==rcan) {
-        reserved_block=b;
-        break;
+  vol->backend=(flash!=NULL)?flash:&stfs_ram_backend;
+  if(vol->victim_policy==NULL) vol->victim_policy=stfs_victim_greedy;
+#ifdef STFS_INDEX
+  index_clear(vol);
+#endif
+  for(b=0,free=0;b<vol->nblocks;b++) {
+    vol->live_chunks[b]=vol->deleted_chunks[b]=0;
+    vol->erase_count[b]=0;
+    clear_oids(vol, b);
+    for(i=0;i<vol->chunks_per_block;i++) {
+      const Chunk *chunk=CHUNK(vol,b,i);
+      visited++;
+      if(chunk->type==Empty) break;
+      if(i==0 && (chunk->type!=Header || chunk->header.magic!=STFS_MAGIC ||
+                  chunk->header.version!=STFS_VERSION)) {
+        // fail, written by another version or not stfs at all
+        LOG(1, "[x] block %d has no version %d header\n", b, STFS_VERSION);
+        ERR(vol) = E_FORMAT;
+        return -1;
+      }
+      if(chunk->type==Header) {
+        if(i==0) vol->erase_count[b]=chunk->header.erase_count;
+        continue;
+      }
+      if(chunk->type==Deleted) {
+        vol->deleted_chunks[b]++;
+        continue;
+      }
+      vol->live_chunks[b]++;
+      if(chunk->type==Inode && chunk->inode.oid>oid_max) {
+        oid_max=chunk->inode.oid;
+      } else if(chunk->type==Data && chunk->data.oid>oid_max) {
+        oid_max=chunk->data.oid;
+      }
+      note_oid(vol, b, chunk);
+#ifdef STFS_INDEX
+      index_add(vol, b, i);
+#endif
+    }
+    vol->frontier[b]=i;
+    if(vol->live_chunks[b]==0 && vol->deleted_chunks[b]==0) free++;
+  }
+  if(info!=NULL) {
+    info->chunks_visited=visited;
+    info->free_blocks=free;
+  }
+
+  vol->vac_src=vol->vac_dest=NBLOCKS;
+  vol->vac_erases=vol->vac_copies=0;
+  // segments from before a remount are not valid anymore
+  NEW_GENERATION(vol);
+#if STFS_STATS > 0
+  memset(&vol->stats,0,sizeof(vol->stats));
+#endif
+#ifdef STFS_TRACE
+  vol->trace_next=0;
+#endif
+#if STFS_SNAPSHOTS > 0
+  memset(vol->pins,0,sizeof(vol->pins));
+  vol->retired=NBLOCKS;
+#endif // STFS_SNAPSHOTS
+#ifndef STFS_INDEX
+  vol->data_hint=0xffffffff;
+#endif
+  vol->write_clock=0;
+  memset(vol->block_stamp,0,sizeof(vol->block_stamp));
+  memset(vol->fdesc,0xff,sizeof(vol->fdesc));
+  path_cache_clear(vol);
+
+  // check if at least one block is empty for migration
+  if(free==0) {
+    if(mount_vacuum(vol)!=0) {
+      // fail no empty blocks
+      LOG(1, "[x] no empty block and none can be vacuumed\n");
+      ERR(vol) = E_FULL;
+      return -1;
+    }
+  } else {
+    rcan=random()%free;
+    for(b=0,i=0;b<vol->nblocks;b++) {
+      if(vol->live_chunks[b]==0 && vol->deleted_chunks[b]==0) {
+        if(i++==rcan) {
+          vol->reserved_block=b;
+          break;
+        }
       }
     }
   }
-  if(b>=NBLOCKS) {
-    // fail no empty blocks
-    return -1;
+
+  // allocate new oids above the high-water mark
+  vol->oid_limit=0xffffffff;
+  vol->oid_next=(oid_max<vol->oid_limit)?oid_max+1:vol->oid_limit;
+  for(i=0;i<STFS_STREAMS;i++) {
+    // picked on the first store
+    vol->append_block[i]=NBLOCKS;
   }
 
-  memset(fdesc,0xff,sizeof(fdesc));
+  return 0;
+}
+
+int stfs_init(STFS_Volume *vol) {
+  return stfs_mount(vol, NULL, NULL);
+}
 
+static int block_info(STFS_Volume *vol, uint32_t block, STFS_BlockInfo *info) {
+  if(block>=vol->nblocks) {
+    ERR(vol) = E_INVBLOCK;
+    return -1;
+  }
+  info->live=vol->live_chunks[block];
+  info->deleted=vol->deleted_chunks[block];
+  info->empty=vol->chunks_per_block-vol->frontier[block];
+  info->reserved=(block==vol->reserved_block || block==vol->vac_dest);
+#if STFS_SNAPSHOTS > 0
+  if(block==vol->retired) info->reserved=1;
+#endif
+  info->age=vol->write_clock-vol->block_stamp[block];
+  info->erases=vol->erase_count[block];
   return 0;
 }
 
-void dump_info(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK]) {
-  uint32_t i, b,c, candidate_reclaim=0, used[NBLOCKS], unused[NBLOCKS], deleted[NBLOCKS];
-  int candidate=-1, reserved=-1;
-  for(i=0;i<NBLOCKS;i++) { used[i]=0; unused[i]=0; deleted[i]=0; }
+int stfs_blockinfo(STFS_Volume *vol, uint32_t block, STFS_BlockInfo *info) {
+  READ_LOCK(vol);
+  const int ret=block_info(vol, block, info);
+  UNLOCK(vol);
+  return ret;
+}
+
+void stfs_vacuum_stats(STFS_Volume *vol, STFS_VacuumStats *stats) {
+  READ_LOCK(vol);
+  stats->erases=vol->vac_erases;
+  stats->copies=vol->vac_copies;
+  UNLOCK(vol);
+}
+
+#ifdef STFS_TRACE
+// copies up to max of the last events into events, oldest first, and
+// returns how many
+uint32_t stfs_trace(STFS_Volume *vol, STFS_TraceEvent *events, uint32_t max) {
+  uint32_t i;
+  WRITE_LOCK(vol);
+  uint32_t n=(vol->trace_next<STFS_TRACE_EVENTS)?vol->trace_next:STFS_TRACE_EVENTS;
+  if(n>max) n=max;
+  for(i=0;i<n;i++) {
+    events[i]=vol->trace[(vol->trace_next-n+i)&(STFS_TRACE_EVENTS-1)];
+  }
+  UNLOCK(vol);
+  return n;
+}
+#endif // STFS_TRACE
+
+// readers count their scans in parallel, the write lock stops them
+void stfs_stats(STFS_Volume *vol, STFS_Stats *stats) {
+  WRITE_LOCK(vol);
+#if STFS_STATS > 0
+  memcpy(stats, &vol->stats, sizeof(*stats));
+#else
+  memset(stats, 0, sizeof(*stats));
+#endif
+  UNLOCK(vol);
+}
+
+void stfs_stats_reset(STFS_Volume *vol) {
+#if STFS_STATS > 0
+  WRITE_LOCK(vol);
+  memset(&vol->stats, 0, sizeof(vol->stats));
+  UNLOCK(vol);
+#endif
+}
+
+void dump_info(STFS_Volume *vol) {
+  uint32_t b, candidate_reclaim=0, min_erases=0xffffffff, max_erases=0;
+  int candidate=-1, reserved=vol->reserved_block;
+  STFS_BlockInfo info;
   LOG(2, "[i] Block stats\n");
-  for(b=0;b<NBLOCKS;b++) {
-    for(c=0;c<CHUNKS_PER_BLOCK;c++) {
-      switch(blocks[b][c].type) {
-      case(Empty): { unused[b]++; break; }
-      case(Deleted): { deleted[b]++; break; }
-      default: { used[b]++; break; }
-      }
-    }
-    if(unused[b]==CHUNKS_PER_BLOCK && reserved==-1) {
-      reserved=b;
-    } else if((unused[b]+deleted[b])>candidate_reclaim) {
+  for(b=0;b<vol->nblocks;b++) {
+    block_info(vol, b, &info);
+    fprintf(stderr, "\t%d %4d %4d %4d %6d\n", b, info.empty, info.live, info.deleted, info.erases);
+    if(info.erases<min_erases) min_erases=info.erases;
+    if(info.erases>max_erases) max_erases=info.erases;
+    if(!info.reserved && (info.empty+info.deleted)>candidate_reclaim) {
       candidate=b;
-      candidate_reclaim=(unused[b]+deleted[b]);
+      candidate_reclaim=(info.empty+info.deleted);
     }
   }
-  for(b=0;b<NBLOCKS;b++) {
-    fprintf(stderr, "\t%d %4d %4d %4d\n", b, unused[b], used[b], deleted[b]);
-  }
   if(reserved==-1 || candidate==-1) {
     fprintf(stderr, "[x] vacuum reserved: %d candidate: %d\n", reserved, candidate);
   } else {
     fprintf(stderr, "[i] would be vacuuming from %d to %d\n", candidate, reserved);
   }
+  fprintf(stderr, "[i] erase count spread %d (%d..%d)\n", max_erases-min_erases, min_erases, max_erases);
 }
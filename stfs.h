@@ -3,15 +3,107 @@
 
 #include <stdint.h>
 #include <unistd.h>
+#ifdef STFS_THREADS
+#include <pthread.h>
+#endif
 
+// the largest geometry supported, sizes all RAM state. a volume can
+// use any geometry within it, see STFS_Volume.
+#ifndef CHUNK_SIZE
 #define CHUNK_SIZE 128
+#endif
+#ifndef CHUNKS_PER_BLOCK
 #define CHUNKS_PER_BLOCK 1024
+#endif
+#ifndef NBLOCKS
 #define NBLOCKS 6
-#define DATA_PER_CHUNK (CHUNK_SIZE-7)
-#define MAX_FILE_SIZE 65535
+#endif
+#define MIN_CHUNK_SIZE 64
+#define DATA_PER_CHUNK (CHUNK_SIZE-9)
+#define INLINE_DATA_SIZE (CHUNK_SIZE-46) // files up to this size live in their inode
+#ifndef MAX_FILE_SIZE
+#define MAX_FILE_SIZE 0x7fffffff
+#endif
+#ifndef MAX_OPEN_FILES
 #define MAX_OPEN_FILES 4
+#endif
 #define MAX_DIR_SIZE 32
 
+// define STFS_INDEX (e.g. CFLAGS="-DSTFS_INDEX" make) to keep an in-RAM
+// index of all data chunks keyed by (oid, seq) and of all inodes keyed
+// by (parent, name). costs 2*(NBLOCKS*CHUNKS_PER_BLOCK +
+// STFS_INDEX_BUCKETS + STFS_DENTRY_BUCKETS) bytes of RAM, twice that
+// with 65535 or more chunks.
+#ifndef STFS_INDEX_BUCKETS
+#define STFS_INDEX_BUCKETS 2048 // must be a power of 2
+#endif
+#ifndef STFS_DENTRY_BUCKETS
+#define STFS_DENTRY_BUCKETS 256 // must be a power of 2
+#endif
+
+// number of resolved paths (including ones that do not exist) to
+// remember, 0 disables the cache. paths longer than
+// STFS_PATH_CACHE_PATHLEN are never cached.
+#ifndef STFS_PATH_CACHE_SIZE
+#define STFS_PATH_CACHE_SIZE 8
+#endif
+#ifndef STFS_PATH_CACHE_PATHLEN
+#define STFS_PATH_CACHE_PATHLEN 64
+#endif
+
+// define STFS_WRITE_BUFFER to collect small sequential writes per
+// descriptor until a chunk is complete, the descriptor writes or
+// seeks elsewhere, or stfs_fsync/stfs_close is called. costs
+// DATA_PER_CHUNK+12 bytes of RAM per descriptor.
+
+// define STFS_THREADS to make the calls on a mounted volume
+// thread-safe: a readers-writer lock lets stfs_read, readdir, opendir,
+// lseek, size, blockinfo and closing an unchanged file run in
+// parallel (lseek and close not while the descriptor buffers writes),
+// everything else runs alone. a descriptor must still be used by one
+// thread at a time, stfs_mount and stfs_set_victim_policy
+// must not run alongside other calls, and stfs_geterrno returns the
+// last error of the calling thread. the first stfs_mount initialises
+// the locks, so a volume has to start out zeroed past the fields set
+// by the caller, as STFS_VOLUME() or any initializer leaves it.
+// remounts reuse the locks.
+
+// a snapshot is a stable image of one file that is read without
+// taking any lock, see stfs_snapshot(). costs 4*NBLOCKS bytes of RAM,
+// 0 leaves them out.
+#ifndef STFS_SNAPSHOTS
+#define STFS_SNAPSHOTS 1
+#endif
+
+// counts what stfs does, see STFS_Stats. 0 compiles the counting
+// out, stfs_stats() then reports zeros.
+#ifndef STFS_STATS
+#define STFS_STATS 1
+#endif
+
+// define STFS_TRACE to record what stfs does in a ring buffer of the
+// last STFS_TRACE_EVENTS STFS_TraceEvents per volume, read out with
+// stfs_trace(). costs 16*STFS_TRACE_EVENTS bytes of RAM. events are
+// stamped with STFS_TRACE_CLOCK(), by default the monotonic clock in
+// ns, define it to any free running 32 bit counter on a target.
+#ifndef STFS_TRACE_EVENTS
+#define STFS_TRACE_EVENTS 1024 // must be a power of 2
+#endif
+
+// number of write streams, each appending to its own block: 1 mixes
+// all chunks, 2 separates inodes from data, 3 also separates
+// overwritten (hot) from appended (cold) data.
+#ifndef STFS_STREAMS
+#define STFS_STREAMS 1
+#endif
+
+// vacuum moves the data of the least erased block to the reserved
+// block once that was erased STFS_WEAR_SPREAD times more often, 0
+// disables this static wear leveling.
+#ifndef STFS_WEAR_SPREAD
+#define STFS_WEAR_SPREAD 32
+#endif
+
 #define O_CREAT 64
 
 #define E_NOFDS     0
@@ -36,6 +128,10 @@
 #define E_DELROOT   19
 #define E_FDREOPEN  20
 #define E_DANGLE    21
+#define E_INVBLOCK  22
+#define E_FLASH     23
+#define E_GEOMETRY  24
+#define E_FORMAT    25
 
 #define SEEK_SET 0
 #define SEEK_CUR 1
@@ -43,6 +139,7 @@
 
 typedef enum {
   Deleted          = 0x00,
+  Header           = 0x55,
   Inode            = 0xAA,
   Data             = 0xCC,
   Empty            = 0xff
@@ -56,25 +153,36 @@ typedef enum {
 typedef struct Inode_Struct {
   InodeType type :1;
   unsigned int name_len :6;
-  int padding: 1;
-  uint16_t size;
+  unsigned int external :1; // 0: file content is stored in data[], 1: in data chunks
+  uint32_t size;
   uint32_t parent;
   uint32_t oid;
   uint8_t name[32];
-  uint8_t data[CHUNK_SIZE - 44];
+  uint8_t data[INLINE_DATA_SIZE];
 } __attribute((packed)) Inode_t;
 
 typedef struct Data_Struct {
-  uint16_t seq;
+  uint32_t seq;
   uint32_t oid;
-  uint8_t data[CHUNK_SIZE-7];
+  uint8_t data[CHUNK_SIZE-9];
 } __attribute((packed)) Data_t;
 
+// first chunk of every block stfs has appended to. mount rejects
+// blocks starting with anything else, or another version.
+#define STFS_MAGIC 0x53465453 // "STFS"
+#define STFS_VERSION 2 // 1: 16 bit file sizes and seqs
+typedef struct Header_Struct {
+  uint32_t magic;
+  uint8_t version;
+  uint32_t erase_count;
+} __attribute((packed)) Header_t;
+
 typedef struct Chunk_Struct {
   ChunkType type :8;
   union {
     Inode_t inode;
     Data_t data;
+    Header_t header;
   };
 } __attribute((packed)) Chunk;
 
@@ -82,30 +190,259 @@ typedef struct {
   uint32_t oid;
   uint32_t block;
   uint32_t chunk;
+  Inode_t inode; // the one readdir() returned last
 } ReaddirCTX;
 
+typedef struct {
+  uint16_t live;     // inode and data chunks
+  uint16_t deleted;  // chunks reclaimable by vacuum
+  uint16_t empty;    // chunks still available for appending
+  uint8_t reserved;  // block is kept empty for vacuuming
+  uint32_t age;      // chunks stored since the block was last appended to
+  uint32_t erases;   // times the block has been erased
+} STFS_BlockInfo;
+
+// returns the block to vacuum, or -1. only blocks that are full,
+// not reserved and have deleted chunks are worth vacuuming.
+typedef int (*STFS_VictimPolicy)(const STFS_BlockInfo *info, uint32_t nblocks);
+
+typedef struct {
+  uint32_t erases;  // blocks erased by vacuum since mount
+  uint32_t copies;  // live chunks copied by vacuum since mount
+} STFS_VacuumStats;
+
+// counted since mount or stfs_stats_reset(), the counters wrap around
+typedef struct {
+  uint32_t scanned;  // chunks read to locate inodes and data
+  uint32_t programs; // chunks programmed, headers and deletions included
+  uint32_t deletes;  // chunks invalidated
+  uint32_t in_place; // chunks rewritten by clearing bits instead of moving them
+  uint32_t vacuums;  // victims vacuumed, synchronously or in steps
+  uint32_t copies;   // live chunks copied by vacuum
+  uint32_t erases;   // blocks erased
+} STFS_Stats;
+
+// flash access, chunks are read directly through the mapped flash.
+// program writes one chunk and must fail instead of setting bits,
+// erase sets a whole block to 0xff.
+typedef struct {
+  int (*program)(void *ctx, void *dst, const void *src, uint32_t size);
+  int (*erase)(void *ctx, void *block, uint32_t size);
+  void *ctx;
+} STFS_Backend;
+
+extern const STFS_Backend stfs_ram_backend;
+
+typedef struct {
+  uint32_t chunks_visited; // chunks read while mounting
+  uint32_t free_blocks;    // completely empty blocks found
+} STFS_MountInfo;
+
+// a trace event, op events carry the STFS_OP_* in op. stfstrace.py
+// turns a dump of them into a chrome trace and latency histograms.
+#define STFS_TRACE_BEGIN    1 // arg: descriptor or 0, size or offset
+#define STFS_TRACE_END      2 // arg: return value, errno
+#define STFS_TRACE_VACUUM   3 // arg: victim block, destination block
+#define STFS_TRACE_VACUUMED 4 // arg: victim block, chunks copied
+#define STFS_TRACE_PROGRAM  5 // arg: chunk number, bytes
+#define STFS_TRACE_ERASE    6 // arg: block, 0
+
+#define STFS_OP_OPEN        1
+#define STFS_OP_CLOSE       2
+#define STFS_OP_READ        3
+#define STFS_OP_WRITE       4
+#define STFS_OP_LSEEK       5
+#define STFS_OP_FSYNC       6
+#define STFS_OP_UNLINK      7
+#define STFS_OP_TRUNCATE    8
+#define STFS_OP_MKDIR       9
+#define STFS_OP_RMDIR       10
+#define STFS_OP_OPENDIR     11
+#define STFS_OP_READDIR     12
+#define STFS_OP_VACUUM_STEP 13
+#define STFS_OP_SNAPSHOT    14
+#define STFS_OP_READ_IOV    15
+
+typedef struct {
+  uint32_t time;
+  uint8_t type;
+  uint8_t op;
+  uint16_t thread; // 0 unless STFS_THREADS, then numbered by first event
+  uint32_t arg[2];
+} STFS_TraceEvent;
+
 typedef struct {
   char free :1;
   char idirty :1;
   char padding :6;
   Chunk ichunk;
   uint32_t fptr;
+#ifdef STFS_WRITE_BUFFER
+  uint32_t wbuf_pos;  // file offset of wbuf[0]
+  uint32_t wbuf_len;  // never extends past the chunk containing wbuf_pos
+  uint32_t wbuf_size; // file size before the buffered writes
+  uint8_t wbuf[DATA_PER_CHUNK];
+#endif // STFS_WRITE_BUFFER
 } STFS_File;
 
-int opendir(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *path, ReaddirCTX *ctx);
-const Inode_t* readdir(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], ReaddirCTX *ctx);
-int stfs_mkdir(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *path);
-int stfs_rmdir(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *path);
-int stfs_open(uint8_t *path, uint32_t oflag, Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK]);
-off_t stfs_lseek(uint32_t fildes, off_t offset, int whence);
-ssize_t stfs_write(uint32_t fildes, const void *buf, size_t nbyte, Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK]);
-ssize_t stfs_read(uint32_t fildes, void *buf, size_t nbyte, Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK]);
-int stfs_close(uint32_t fildes, Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK]);
-int stfs_unlink(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK], uint8_t *path);
-int stfs_truncate(uint8_t *path, uint32_t length, Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK]);
-int stfs_init(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK]);
-int stfs_geterrno(void);
-
-uint32_t stfs_size(uint32_t fildes);
+// chunks are referred to by their number, b*chunks_per_block+c
+#if NBLOCKS*CHUNKS_PER_BLOCK < 0xffff
+typedef uint16_t STFS_ChunkRef;
+#else
+typedef uint32_t STFS_ChunkRef;
+#endif
+
+typedef struct {
+  uint32_t hash;
+  uint32_t oid; // 0 if the path does not exist
+  uint16_t block;
+  uint16_t chunk;
+  uint8_t len;  // 0 if the entry is unused
+  uint8_t path[STFS_PATH_CACHE_PATHLEN];
+} STFS_PathCacheEntry;
+
+// the flash of a volume holds nblocks blocks of chunks_per_block
+// chunks of chunk_size bytes. the geometry is fixed at mount and must
+// be within CHUNK_SIZE, CHUNKS_PER_BLOCK and NBLOCKS. everything after
+// victim_policy is the state of the mounted volume, private to stfs.c
+// and set up by stfs_mount(). volumes share nothing, so any number of
+// them can be used at once, but each by one thread at a time.
+typedef struct {
+  uint8_t *flash;
+  uint32_t chunk_size;
+  uint32_t chunks_per_block;
+  uint32_t nblocks;
+  STFS_VictimPolicy victim_policy; // NULL for stfs_victim_greedy
+
+  const STFS_Backend *backend;
+  STFS_File fdesc[MAX_OPEN_FILES];
+  uint32_t err;
+  uint32_t reserved_block;
+  // incremental vacuum, vac_pos is the next chunk of vac_src to copy
+  // into vac_dest, both are NBLOCKS if no vacuum is running
+  uint32_t vac_src, vac_dest, vac_pos;
+  uint32_t vac_erases, vac_copies;
+#if STFS_STATS > 0
+  STFS_Stats stats;
+#endif
+  // read from the block headers on mount, 0 for blocks without one
+  uint32_t erase_count[NBLOCKS];
+  // chunks stored since mount, and when each block was last appended to
+  uint32_t write_clock;
+  uint32_t block_stamp[NBLOCKS];
+  // blocks are filled strictly in order, frontier[b] is the first empty
+  // chunk of block b, new chunks are appended to the block of their
+  // write stream.
+  uint16_t frontier[NBLOCKS];
+  uint32_t append_block[STFS_STREAMS];
+  // number of inode/data and deleted chunks in each block, the empty
+  // chunks are chunks_per_block-frontier[b]
+  uint16_t live_chunks[NBLOCKS];
+  uint16_t deleted_chunks[NBLOCKS];
+  // oids of the inode and data chunks stored in each block since it
+  // was erased, lookups skip the blocks whose range does not contain
+  // the oid. min>max if the block holds no such chunk.
+  uint32_t inode_oid_min[NBLOCKS], inode_oid_max[NBLOCKS];
+  uint32_t data_oid_min[NBLOCKS], data_oid_max[NBLOCKS];
+  // oids in [oid_next, oid_limit) are known to be unused
+  uint32_t oid_next;
+  uint32_t oid_limit;
+#ifdef STFS_INDEX
+  // data chunks hashing into the same bucket are chained via
+  // chunk_next[], the key (oid, seq) is not stored in RAM, it is read
+  // back from the chunk header. inodes are chained the same way from
+  // dentry_head[] keyed by (parent, name), a chunk is either data or
+  // an inode, so both can share chunk_next[].
+  STFS_ChunkRef data_head[STFS_INDEX_BUCKETS];
+  STFS_ChunkRef dentry_head[STFS_DENTRY_BUCKETS];
+  STFS_ChunkRef chunk_next[NBLOCKS*CHUNKS_PER_BLOCK];
+#else
+  // the last data chunk found, b*chunks_per_block+c, 0xffffffff if none
+  uint32_t data_hint;
+#endif // STFS_INDEX
+#if STFS_PATH_CACHE_SIZE > 0
+  STFS_PathCacheEntry path_cache[STFS_PATH_CACHE_SIZE];
+  uint32_t path_cache_next;
+#endif // STFS_PATH_CACHE_SIZE
+#if STFS_SNAPSHOTS > 0
+  // number of snapshots reading chunks of each block. a vacuumed
+  // block that is pinned is retired instead of erased, it becomes the
+  // reserved block once the last of them is released.
+  uint32_t pins[NBLOCKS];
+  uint32_t retired; // NBLOCKS if no block is retired
+#endif // STFS_SNAPSHOTS
+  // bumped before anything that could change or move the bytes
+  // stfs_read_iov() points to
+  uint32_t generation;
+#ifdef STFS_TRACE
+  STFS_TraceEvent trace[STFS_TRACE_EVENTS];
+  uint32_t trace_next; // events recorded since mount
+#endif // STFS_TRACE
+#ifdef STFS_THREADS
+  pthread_rwlock_t lock;
+  pthread_mutex_t cache_lock; // the path cache is filled by readers too
+  uint32_t locks_init; // 0 until the first mount initialises the locks
+#endif // STFS_THREADS
+} STFS_Volume;
+
+// a volume with the largest geometry on a Chunk[NBLOCKS][CHUNKS_PER_BLOCK]
+#define STFS_VOLUME(blocks) { (uint8_t*) (blocks), CHUNK_SIZE, CHUNKS_PER_BLOCK, NBLOCKS }
+#define STFS_DATA_PER_CHUNK(vol) ((vol)->chunk_size-9)
+#define STFS_INLINE_DATA_SIZE(vol) ((vol)->chunk_size-46)
+
+// the file as it was when stfs_snapshot() took it. refs[seq] is the
+// chunk holding seq, refs needs one entry per STFS_DATA_PER_CHUNK
+// bytes of the file, none if it is stored inline.
+typedef struct {
+  STFS_Volume *vol;
+  Inode_t inode;
+  const STFS_ChunkRef *refs;
+  uint8_t pinned[(NBLOCKS+7)/8]; // the blocks refs point into
+} STFS_Snapshot;
+
+// a piece of a file, see stfs_read_iov()
+typedef struct {
+  const uint8_t *data;
+  uint32_t len;
+} STFS_Segment;
+
+int opendir(STFS_Volume *vol, uint8_t *path, ReaddirCTX *ctx);
+const Inode_t* readdir(STFS_Volume *vol, ReaddirCTX *ctx);
+int stfs_mkdir(STFS_Volume *vol, uint8_t *path);
+int stfs_rmdir(STFS_Volume *vol, uint8_t *path);
+int stfs_open(uint8_t *path, uint32_t oflag, STFS_Volume *vol);
+off_t stfs_lseek(uint32_t fildes, off_t offset, int whence, STFS_Volume *vol);
+ssize_t stfs_write(uint32_t fildes, const void *buf, size_t nbyte, STFS_Volume *vol);
+ssize_t stfs_read(uint32_t fildes, void *buf, size_t nbyte, STFS_Volume *vol);
+ssize_t stfs_read_iov(uint32_t fildes, STFS_Segment *segs, uint32_t *nsegs, size_t nbyte, STFS_Volume *vol);
+uint32_t stfs_generation(STFS_Volume *vol);
+int stfs_close(uint32_t fildes, STFS_Volume *vol);
+int stfs_fsync(uint32_t fildes, STFS_Volume *vol);
+int stfs_unlink(STFS_Volume *vol, uint8_t *path);
+int stfs_truncate(uint8_t *path, uint32_t length, STFS_Volume *vol);
+int stfs_init(STFS_Volume *vol);
+int stfs_mount(STFS_Volume *vol, const STFS_Backend *backend, STFS_MountInfo *info);
+int stfs_vacuum_step(STFS_Volume *vol, uint32_t budget);
+void stfs_set_victim_policy(STFS_Volume *vol, STFS_VictimPolicy policy);
+int stfs_victim_greedy(const STFS_BlockInfo *info, uint32_t nblocks);
+int stfs_victim_cost_benefit(const STFS_BlockInfo *info, uint32_t nblocks);
+int stfs_victim_deterministic(const STFS_BlockInfo *info, uint32_t nblocks);
+void stfs_vacuum_stats(STFS_Volume *vol, STFS_VacuumStats *stats);
+void stfs_stats(STFS_Volume *vol, STFS_Stats *stats);
+void stfs_stats_reset(STFS_Volume *vol);
+int stfs_geterrno(STFS_Volume *vol);
+int stfs_blockinfo(STFS_Volume *vol, uint32_t block, STFS_BlockInfo *info);
+
+uint32_t stfs_size(uint32_t fildes, STFS_Volume *vol);
+
+#ifdef STFS_TRACE
+uint32_t stfs_trace(STFS_Volume *vol, STFS_TraceEvent *events, uint32_t max);
+#endif // STFS_TRACE
+
+#if STFS_SNAPSHOTS > 0
+int stfs_snapshot(STFS_Volume *vol, uint8_t *path, STFS_Snapshot *snap, STFS_ChunkRef *refs, uint32_t nrefs);
+ssize_t stfs_snapshot_read(STFS_Snapshot *snap, uint32_t offset, void *buf, size_t nbyte);
+void stfs_snapshot_release(STFS_Snapshot *snap);
+#endif // STFS_SNAPSHOTS
 
 #endif //STFS_H
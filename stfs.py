@@ -1,44 +1,65 @@
 #!/usr/bin/env python
 
+import struct
 import construct
 
+# the geometry of the images, as in stfs.h
+CHUNK_SIZE = 128
+CHUNKS_PER_BLOCK = 1024
+DATA_PER_CHUNK = CHUNK_SIZE-9
+INLINE_DATA_SIZE = CHUNK_SIZE-46
+
 # typedef struct Inode_Struct {
 #   InodeType type :1;
-#   int name_len :6;
-#   int padding: 1;
-#   uint16_t size;
+#   unsigned int name_len :6;
+#   unsigned int external :1;
+#   uint32_t size;
 #   uint32_t parent;
 #   uint32_t oid;
 #   uint8_t name[32];
-#   uint8_t data[CHUNK_SIZE - 44];
+#   uint8_t data[INLINE_DATA_SIZE];
 # } __attribute((packed)) Inode_t;
 
+# gcc allocates bitfields from the lsb, BitStruct parses from the msb
 Inode = construct.Struct(
     'bits'/construct.BitStruct(
-        'type'/construct.Flag,
+        'external'/construct.Flag,
         "name_len"/construct.BitsInteger(6),
-        construct.Padding(1)),
-    "size"/construct.Int16ul,
+        'type'/construct.Flag),
+    "size"/construct.Int32ul,
     'parent'/construct.Int32ul,
     'oid'/construct.Int32ul,
     'name'/construct.String(length=32),
-    'data'/construct.String(length=84),
+    'data'/construct.String(length=INLINE_DATA_SIZE),
 )
 
 # typedef struct Data_Struct {
-#   uint16_t seq;
+#   uint32_t seq;
 #   uint32_t oid;
-#   uint8_t data[CHUNK_SIZE-8];
+#   uint8_t data[CHUNK_SIZE-9];
 # } __attribute((packed)) Data_t;
 
 Dnode = construct.Struct(
-    'seq'/construct.Int16ul,
+    'seq'/construct.Int32ul,
     'oid'/construct.Int32ul,
-    'data'/construct.String(length=121),
+    'data'/construct.String(length=DATA_PER_CHUNK),
+)
+
+# typedef struct Header_Struct {
+#   uint32_t magic;
+#   uint8_t version;
+#   uint32_t erase_count;
+# } __attribute((packed)) Header_t;
+
+Header = construct.Struct(
+    'magic'/construct.Int32ul,
+    'version'/construct.Int8ul,
+    'erase_count'/construct.Int32ul,
 )
 
 # typedef enum {
 #   Deleted          = 0x00,
+#   Header           = 0x55,
 #   Inode            = 0xAA,
 #   Data             = 0xCC,
 #   Empty            = 0xff
@@ -46,6 +67,7 @@ Dnode = construct.Struct(
 ChunkType = construct.Enum(
     construct.Int8ul,
     Deleted = 0x00,
+    Header  = 0x55,
     Inode   = 0xAA,
     Data    = 0xCC,
     Empty   = 0xff)
@@ -55,11 +77,27 @@ ChunkType = construct.Enum(
 #   union {
 #     Inode_t inode;
 #     Data_t data;
+#     Header_t header;
 #   };
 # } __attribute((packed)) Chunk;
 
 Chunk = construct.Struct(
     "type"/ChunkType,
     "node"/construct.Union("dnode"/Dnode,
-                           "inode"/Inode),
+                           "inode"/Inode,
+                           "header"/Header),
 )
+
+# the data area of an external inode journals its size: the last word
+# that is not 0xffffffff is the size, the size field while there is none
+def inode_size(inode):
+    size = inode.size
+    if not inode.bits.external:
+        return size
+    data = inode.data
+    for i in range(0, len(data)-3, 4):
+        word, = struct.unpack_from('<I', data, i)
+        if word == 0xffffffff:
+            break
+        size = word
+    return size
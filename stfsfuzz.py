@@ -5,7 +5,7 @@ import sys
 
 import sh
 afl = sh.Command("./afl");
-from stfs import Chunk
+from stfs import Chunk, inode_size, CHUNK_SIZE, CHUNKS_PER_BLOCK, DATA_PER_CHUNK
 from binascii import hexlify
 
 
@@ -40,8 +40,8 @@ def check():
     used=[0,0,0,0,0,0]
     deleted=[0,0,0,0,0,0]
 
-    for b, block in enumerate(split_by_n(img,128*1024)):
-        for c, raw in enumerate(split_by_n(block,128)):
+    for b, block in enumerate(split_by_n(img,CHUNK_SIZE*CHUNKS_PER_BLOCK)):
+        for c, raw in enumerate(split_by_n(block,CHUNK_SIZE)):
             chunk=Chunk.parse(raw)
             if chunk.type == "Data":
                 used[b]+=1
@@ -62,7 +62,8 @@ def check():
                                                    'oid': chunk.node.inode.oid,
                                                    'type': chunk.node.inode.bits.type,
                                                    'parent': chunk.node.inode.parent,
-                                                   'size': chunk.node.inode.size,
+                                                   'size': inode_size(chunk.node.inode),
+                                                   'external': chunk.node.inode.bits.external,
                                                    'name': name}
                 else:
                     if 'parent' in objects[chunk.node.inode.oid]:
@@ -72,7 +73,8 @@ def check():
                         name = chunk.node.inode.name[:nsize]
                         objects[chunk.node.inode.oid]['type']=chunk.node.inode.bits.type
                         objects[chunk.node.inode.oid]['parent']=chunk.node.inode.parent
-                        objects[chunk.node.inode.oid]['size']=chunk.node.inode.size
+                        objects[chunk.node.inode.oid]['size']=inode_size(chunk.node.inode)
+                        objects[chunk.node.inode.oid]['external']=chunk.node.inode.bits.external
                         objects[chunk.node.inode.oid]['name']=name
             elif chunk.type == "Empty":
                 empty[b]+=1
@@ -84,7 +86,7 @@ def check():
             if obj['oid']!=1:
                 print "orphan\t%3d blocks (%dB) of %x [%s..%s]" % (
                     len(obj['seq']),
-                    len(obj['seq'])*121,
+                    len(obj['seq'])*DATA_PER_CHUNK,
                     obj['oid'],
                     str(obj['seq'][:3])[1:-1],
                     str(obj['seq'][-3:])[1:-1])
@@ -103,10 +105,12 @@ def check():
         #    if i!=seq:
         #        print "missing chunk %d, from" % i, obj
         if obj['type']==1: # files
-            if (obj['size']/121)+1>len(obj['seq']) and obj['size']%121!=0:
-               print "[x] only %d chunks (%d B) for %d bytes - %s" % (len(obj['seq']), len(obj['seq'])*121, obj['size'], obj['path'])
+            if not obj['external']:
+                print "[o] %d bytes (inline) - %s" % (obj['size'], obj['path'])
+            elif (obj['size']/DATA_PER_CHUNK)+1>len(obj['seq']) and obj['size']%DATA_PER_CHUNK!=0:
+               print "[x] only %d chunks (%d B) for %d bytes - %s" % (len(obj['seq']), len(obj['seq'])*DATA_PER_CHUNK, obj['size'], obj['path'])
             elif (obj['size']<len(obj['seq'])):
-               print "[i] %d chunks (%d B) for only %d bytes - %s" % (len(obj['seq']), len(obj['seq'])*121, obj['size'], obj['path'])
+               print "[i] %d chunks (%d B) for only %d bytes - %s" % (len(obj['seq']), len(obj['seq'])*DATA_PER_CHUNK, obj['size'], obj['path'])
             else:
                 print "[o] %d bytes - %s" % (obj['size'], obj['path'])
         else: # directories
@@ -0,0 +1,124 @@
+#!/usr/bin/env python
+# converts a dump of STFS_TraceEvents (see stfs_trace()) into a chrome
+# trace, to be opened in chrome://tracing or ui.perfetto.dev, and
+# prints per op latency histograms and the slowest calls with the
+# vacuums, programs and erases they absorbed.
+#
+# usage: stfstrace.py <dump> [trace.json] [ns per clock tick]
+
+from __future__ import print_function
+import sys
+import json
+import struct
+
+EVENT = struct.Struct('<IBBHII')
+
+BEGIN, END, VACUUM, VACUUMED, PROGRAM, ERASE = range(1, 7)
+OPS = [None, 'open', 'close', 'read', 'write', 'lseek', 'fsync', 'unlink',
+       'truncate', 'mkdir', 'rmdir', 'opendir', 'readdir', 'vacuum_step',
+       'snapshot', 'read_iov']
+SLOWEST = 10
+
+def signed(v):
+    return v-(1<<32) if v&(1<<31) else v
+
+def read_events(path, tick_ns):
+    with open(path, 'rb') as fd:
+        raw = fd.read()
+    events = []
+    prev = now = None
+    for off in range(0, len(raw)-EVENT.size+1, EVENT.size):
+        time, type, op, thread, arg0, arg1 = EVENT.unpack_from(raw, off)
+        # the clock is 32 bit, events are assumed to be less than half a
+        # wrap apart. threads may record slightly out of order, so the
+        # difference can be negative.
+        now = 0 if prev is None else now+signed((time-prev) & 0xffffffff)
+        prev = time
+        events.append((now*tick_ns/1000.0, type, op, thread, arg0, arg1))
+    # stable, so the events of one thread keep their order
+    events.sort(key=lambda e: e[0])
+    start = events[0][0] if events else 0
+    return [(e[0]-start,)+e[1:] for e in events]
+
+def convert(events):
+    trace = []
+    calls = []
+    open_calls = {} # per thread, the op call in progress
+    for ts, type, op, thread, arg0, arg1 in events:
+        name = OPS[op] if op < len(OPS) and OPS[op] else 'op%d' % op
+        base = {'pid': 1, 'tid': thread, 'ts': ts}
+        call = open_calls.get(thread)
+        if type == BEGIN:
+            trace.append(dict(base, name=name, ph='B', args={'arg0': arg0, 'arg1': arg1}))
+            open_calls[thread] = {'op': name, 'start': ts, 'vacuums': 0, 'programs': 0, 'erases': 0}
+        elif type == END:
+            if call is None:
+                continue # began before the oldest event in the dump
+            trace.append(dict(base, name=name, ph='E', args={'ret': signed(arg0), 'errno': arg1}))
+            call['us'] = ts-call['start']
+            calls.append(call)
+            del open_calls[thread]
+        elif type == VACUUM:
+            trace.append(dict(base, name='vacuum', ph='B', args={'victim': arg0, 'dest': arg1}))
+            if call is not None:
+                call['vacuums'] += 1
+        elif type == VACUUMED:
+            trace.append(dict(base, name='vacuum', ph='E', args={'copied': arg1}))
+        elif type == PROGRAM:
+            trace.append(dict(base, name='program', ph='i', s='t', args={'chunk': arg0, 'bytes': arg1}))
+            if call is not None:
+                call['programs'] += 1
+        elif type == ERASE:
+            trace.append(dict(base, name='erase', ph='i', s='t', args={'block': arg0}))
+            if call is not None:
+                call['erases'] += 1
+    # a vacuum cut off at the start of the dump has no begin
+    depth = {}
+    kept = []
+    for e in trace:
+        if e['name'] == 'vacuum':
+            d = depth.get(e['tid'], 0)
+            if e['ph'] == 'E' and d == 0:
+                continue
+            depth[e['tid']] = d+1 if e['ph'] == 'B' else d-1
+        kept.append(e)
+    return kept, calls
+
+def percentile(sorted_us, p):
+    return sorted_us[min(len(sorted_us)-1, len(sorted_us)*p//100)]
+
+def histograms(calls):
+    ops = sorted(set(c['op'] for c in calls))
+    for op in ops:
+        us = sorted(c['us'] for c in calls if c['op'] == op)
+        vacuumed = sum(1 for c in calls if c['op'] == op and c['vacuums'])
+        print('%s: %d calls, p50 %.2fus, p99 %.2fus, max %.2fus, %d absorbed a vacuum' %
+              (op, len(us), percentile(us, 50), percentile(us, 99), us[-1], vacuumed))
+        buckets = {}
+        for u in us:
+            b = 0
+            while (1 << b) <= u:
+                b += 1
+            buckets[b] = buckets.get(b, 0)+1
+        for b in sorted(buckets):
+            low = 0 if b == 0 else 1 << (b-1)
+            print('  %8d - %8dus %7d %s' % (low, 1 << b, buckets[b], '#'*(50*buckets[b]//len(us) or 1)))
+    print('slowest calls:')
+    for c in sorted(calls, key=lambda c: -c['us'])[:SLOWEST]:
+        print('  %-12s %10.2fus %d vacuums, %d programs, %d erases' %
+              (c['op'], c['us'], c['vacuums'], c['programs'], c['erases']))
+
+def main():
+    if len(sys.argv) < 2:
+        print('usage: %s <dump> [trace.json] [ns per clock tick]' % sys.argv[0])
+        sys.exit(1)
+    tick_ns = float(sys.argv[3]) if len(sys.argv) > 3 else 1.0
+    trace, calls = convert(read_events(sys.argv[1], tick_ns))
+    if len(sys.argv) > 2:
+        with open(sys.argv[2], 'w') as fd:
+            json.dump({'traceEvents': trace, 'displayTimeUnit': 'ns'}, fd)
+    if calls:
+        histograms(calls)
+
+if __name__ == '__main__':
+    main()
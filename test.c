@@ -1,14 +1,36 @@
 #include "stfs.h"
+#include "backend.h"
 #include <string.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <time.h>
 
 void dump(uint8_t *src, uint32_t len);
 void dump_inode(const Inode_t *inode);
 void dump_chunk(Chunk *chunk);
 
+// counts chunks that were programmed since the last call
+static uint32_t programmed(Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK]) {
+  static Chunk shadow[NBLOCKS][CHUNKS_PER_BLOCK];
+  uint32_t b,c,n=0;
+  for(b=0;b<NBLOCKS;b++) {
+    for(c=0;c<CHUNKS_PER_BLOCK;c++) {
+      if(memcmp(&shadow[b][c], &blocks[b][c], sizeof(Chunk))!=0) n++;
+    }
+  }
+  memcpy(shadow, blocks, sizeof(shadow));
+  return n;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
 int main(void) {
   Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK];
+  STFS_Volume vol=STFS_VOLUME(blocks);
   memset(blocks,0xff,sizeof(blocks));
 
   uint8_t testdir[]="/test";
@@ -29,78 +51,82 @@ int main(void) {
   printf("[i] data is: %dB\n", sizeof(Data_t));
   printf("[i] block is: %.2fKB\n", sizeof(blocks[0])/1024.0);
   printf("[x] initializing\n");
-  if(stfs_init(blocks)==-1) {
+  // run on simulated nor flash to account program and erase time
+  STFS_NorSim nor;
+  STFS_Backend flash;
+  stfs_nor_init(&nor, &flash);
+  if(stfs_mount(&vol, &flash, NULL)==-1) {
     return 1;
   };
   // testing mkdir
-  printf("[?] mkdir %s, returns %d\n", testdir, stfs_mkdir(blocks, testdir));
+  printf("[?] mkdir %s, returns %d\n", testdir, stfs_mkdir(&vol, testdir));
   dump_chunk(&blocks[0][0]);
   dump((uint8_t*) blocks,128);
 
   dump_chunk(&blocks[0][1]);
   //dump((uint8_t*) &blocks[0][1],128);
-  printf("[?] mkdir %s returns %d\n", testdir2, stfs_mkdir(blocks, testdir2));
+  printf("[?] mkdir %s returns %d\n", testdir2, stfs_mkdir(&vol, testdir2));
   dump_chunk(&blocks[0][1]);
   //dump((uint8_t*) &blocks[0][1],128);
 
   dump_chunk(&blocks[0][2]);
   //dump((uint8_t*) &blocks[0][2],128);
-  printf("[?] mkdir %s returns %d\n", testdir3, stfs_mkdir(blocks, testdir3));
+  printf("[?] mkdir %s returns %d\n", testdir3, stfs_mkdir(&vol, testdir3));
   dump_chunk(&blocks[0][2]);
   //dump((uint8_t*) &blocks[0][2],128);
 
-  printf("[?] mkdir %s returns %d\n", testdir4, stfs_mkdir(blocks, testdir4));
-  printf("[?] mkdir %s returns %d\n", testdir5, stfs_mkdir(blocks, testdir5));
-  printf("[?] mkdir %s returns %d\n", testdir6, stfs_mkdir(blocks, testdir6));
-  printf("[?] mkdir %s returns %d\n", testdir3, stfs_mkdir(blocks, testdir3));
+  printf("[?] mkdir %s returns %d\n", testdir4, stfs_mkdir(&vol, testdir4));
+  printf("[?] mkdir %s returns %d\n", testdir5, stfs_mkdir(&vol, testdir5));
+  printf("[?] mkdir %s returns %d\n", testdir6, stfs_mkdir(&vol, testdir6));
+  printf("[?] mkdir %s returns %d\n", testdir3, stfs_mkdir(&vol, testdir3));
 
   // basic getdents aka ls /test
   ReaddirCTX ctx;
-  opendir(blocks, rootpath, &ctx);
+  opendir(&vol, rootpath, &ctx);
   const Inode_t *inode;
-  while((inode=readdir(blocks, &ctx))!=0) {
+  while((inode=readdir(&vol, &ctx))!=0) {
     dump_inode(inode);
   }
 
   // testing rmdir
   dump_chunk(&blocks[0][0]);
-  printf("[?] rmdir %s returns %d\n", testdir, stfs_rmdir(blocks, testdir));
+  printf("[?] rmdir %s returns %d\n", testdir, stfs_rmdir(&vol, testdir));
   dump_chunk(&blocks[0][0]);
   dump_chunk(&blocks[0][1]);
-  printf("[?] rmdir %s returns %d\n", testdir2, stfs_rmdir(blocks, testdir2));
+  printf("[?] rmdir %s returns %d\n", testdir2, stfs_rmdir(&vol, testdir2));
   dump_chunk(&blocks[0][1]);
 
   // ls /test
-  opendir(blocks, rootpath, &ctx);
-  while((inode=readdir(blocks, &ctx))!=0) {
+  opendir(&vol, rootpath, &ctx);
+  while((inode=readdir(&vol, &ctx))!=0) {
     dump_inode(inode);
   }
 
   // file op tests
   // open create?
-  int fd=stfs_open(testfile, O_CREAT, blocks);
+  int fd=stfs_open(testfile, O_CREAT, &vol);
   printf("[?] open %s o_creat returns %d\n", testfile, fd);
 
   // write data
   uint8_t data0[256];
   int i, ret;
   for(i=0;i<sizeof(data0);i++) data0[i]=i;
-  if((ret=stfs_write(fd, data0, 256, blocks))!=256) {
+  if((ret=stfs_write(fd, data0, 256, &vol))!=256) {
     // fail to write
     printf("[x] write 256 returns %d\n", ret);
   }
   // lseek tests
-  printf("[i] lseek start: %ld\n", stfs_lseek(fd, 0, SEEK_SET));
-  printf("[i] lseek end: %ld\n", stfs_lseek(fd, 0, SEEK_END));
-  printf("[i] lseek mid: %ld\n", stfs_lseek(fd, -128, SEEK_CUR));
-  printf("[i] lseek err: %ld\n", stfs_lseek(fd, 256, SEEK_CUR));
-  printf("[i] lseek err: %ld\n", stfs_lseek(fd, -256, SEEK_CUR));
-  stfs_lseek(fd, 0, SEEK_SET);
+  printf("[i] lseek start: %ld\n", stfs_lseek(fd, 0, SEEK_SET, &vol));
+  printf("[i] lseek end: %ld\n", stfs_lseek(fd, 0, SEEK_END, &vol));
+  printf("[i] lseek mid: %ld\n", stfs_lseek(fd, -128, SEEK_CUR, &vol));
+  printf("[i] lseek err: %ld\n", stfs_lseek(fd, 256, SEEK_CUR, &vol));
+  printf("[i] lseek err: %ld\n", stfs_lseek(fd, -256, SEEK_CUR, &vol));
+  stfs_lseek(fd, 0, SEEK_SET, &vol);
 
   // re-read data from yet unclosed file and verify it
   uint8_t data0r[256];
   memset(data0r,0,256);
-  ret = stfs_read(fd, data0r, 256, blocks);
+  ret = stfs_read(fd, data0r, 256, &vol);
   if(ret!=256) {
     printf("[x] short write: %d\n", ret);
   }
@@ -112,8 +138,8 @@ int main(void) {
 
   // also try short read only 64B
   memset(data0r,0,sizeof(data0r));
-  stfs_lseek(fd, 0, SEEK_SET);
-  ret = stfs_read(fd, data0r, 64, blocks);
+  stfs_lseek(fd, 0, SEEK_SET, &vol);
+  ret = stfs_read(fd, data0r, 64, &vol);
   if(ret!=64) {
     printf("[x] short read: %d\n", ret);
   } else {
@@ -122,8 +148,8 @@ int main(void) {
 
   // also try short read only 64B but spanning eof
   memset(data0r,0,sizeof(data0r));
-  stfs_lseek(fd, -1, SEEK_END);
-  ret = stfs_read(fd, data0r, 64, blocks);
+  stfs_lseek(fd, -1, SEEK_END, &vol);
+  ret = stfs_read(fd, data0r, 64, &vol);
   if(ret!=1) {
     printf("[x] short read: %d\n", ret);
   } else {
@@ -131,15 +157,15 @@ int main(void) {
   }
 
   // close fd
-  printf("[?] close returns %d\n",stfs_close(fd, blocks));
+  printf("[?] close returns %d\n",stfs_close(fd, &vol));
 
   // reopen file
-  fd=stfs_open(testfile, 0, blocks);
+  fd=stfs_open(testfile, 0, &vol);
   printf("[i] fd after reopen %d\n", fd);
 
   // re-read file and verify with original data
   memset(data0r,0,256);
-  ret = stfs_read(fd, data0r, 256, blocks);
+  ret = stfs_read(fd, data0r, 256, &vol);
   if(ret!=256) {
     printf("[x] short write: %d\n", ret);
   }
@@ -148,46 +174,46 @@ int main(void) {
   } else {
     printf("[!] verified correctly saved file with original\n");
   }
-  printf("[?] close returns %d\n",stfs_close(fd, blocks));
+  printf("[?] close returns %d\n",stfs_close(fd, &vol));
 
   // test truncate
-  stfs_truncate(testfile, 16, blocks);
+  stfs_truncate(testfile, 16, &vol);
 
   // try to read 256 of truncated to 16 bytes file
-  fd=stfs_open(testfile, 0, blocks);
+  fd=stfs_open(testfile, 0, &vol);
   printf("[i] fd after reopen %d\n", fd);
 
   memset(data0r,0,256);
-  ret = stfs_read(fd, data0r, 256, blocks);
+  ret = stfs_read(fd, data0r, 256, &vol);
   if(ret!=16) {
     printf("[x] short write: %d\n", ret);
   } else {
     dump(data0r,sizeof(data0r));
   }
-  printf("[?] close returns %d\n",stfs_close(fd, blocks));
+  printf("[?] close returns %d\n",stfs_close(fd, &vol));
 
   // unlink file
-  stfs_unlink(blocks, testfile);
+  stfs_unlink(&vol, testfile);
 
   // re-create file
-  fd=stfs_open(testfile2, O_CREAT, blocks);
+  fd=stfs_open(testfile2, O_CREAT, &vol);
   printf("[?] open %s o_creat returns %d\n", testfile2, fd);
   // try to write to file 1 byte a time, not creating new chunks, but
   // updating the latest
   for(i=0;i<sizeof(data0);i++) {
-    if((ret=stfs_write(fd, &data0[i], 1, blocks))!=1) {
+    if((ret=stfs_write(fd, &data0[i], 1, &vol))!=1) {
       // fail to write
       printf("[x] write 1 returns %d\n", ret);
     }
   }
-  printf("[?] close returns %d\n",stfs_close(fd, blocks));
+  printf("[?] close returns %d\n",stfs_close(fd, &vol));
 
-  fd=stfs_open(testfile2, 0, blocks);
+  fd=stfs_open(testfile2, 0, &vol);
   printf("[i] fd after reopen %d\n", fd);
 
   // verify that the short writes also produce a valid file
   memset(data0r,0,256);
-  ret = stfs_read(fd, data0r, 256, blocks);
+  ret = stfs_read(fd, data0r, 256, &vol);
   if(ret!=256) {
     printf("[x] short write: %d\n", ret);
   }
@@ -196,46 +222,91 @@ int main(void) {
   } else {
     printf("[!] verified correctly saved file with original\n");
   }
-  printf("[?] close returns %d\n",stfs_close(fd, blocks));
+  printf("[?] close returns %d\n",stfs_close(fd, &vol));
 
   uint8_t howdy[]="hello world";
-  fd=stfs_open(testfile2, 0, blocks);
-  stfs_lseek(fd,16,SEEK_SET);
-  stfs_write(fd, howdy, sizeof(howdy), blocks);
-  stfs_lseek(fd,0,SEEK_SET);
+  fd=stfs_open(testfile2, 0, &vol);
+  stfs_lseek(fd, 16, SEEK_SET, &vol);
+  stfs_write(fd, howdy, sizeof(howdy), &vol);
+  stfs_lseek(fd, 0, SEEK_SET, &vol);
   memset(data0r,0,256);
-  ret = stfs_read(fd, data0r, 256, blocks);
+  ret = stfs_read(fd, data0r, 256, &vol);
   if(ret!=256) {
     printf("[x] short read: %d\n", ret);
   }
   dump(data0r,sizeof(data0r));
-  printf("[?] close returns %d\n",stfs_close(fd, blocks));
-
-  printf("[i] writing 64KB file\n");
-  fd=stfs_open(testfilebig, O_CREAT, blocks);
+  printf("[?] close returns %d\n",stfs_close(fd, &vol));
+
+#ifdef STFS_WRITE_BUFFER
+  printf("[i] appending 256 16B records (write buffer)\n");
+#else
+  printf("[i] appending 256 16B records (no write buffer)\n");
+#endif
+  uint8_t testlog[]="/log";
+  fd=stfs_open(testlog, O_CREAT, &vol);
+  programmed(blocks);
+  uint32_t nprog=0;
+  for(i=0;i<256;i++) {
+    if((ret=stfs_write(fd, &data0[i&0xf0], 16, &vol))!=16) {
+      printf("[x] write 16 returns %d\n", ret);
+      break;
+    }
+    nprog+=programmed(blocks);
+  }
+  printf("[?] close returns %d\n",stfs_close(fd, &vol));
+  nprog+=programmed(blocks);
+  printf("[i] %d chunks programmed, write amplification %.1f\n", nprog, (double) nprog*CHUNK_SIZE/(256*16));
+#if defined(STFS_WRITE_BUFFER) && STFS_STREAMS>=3
+  // buffered appends still count as appends, the tail of the log has
+  // to be in the block of the cold stream (2)
+  STFS_Segment tail;
+  uint32_t ntail=1;
+  fd=stfs_open(testlog, 0, &vol);
+  stfs_lseek(fd, -16, SEEK_END, &vol);
+  stfs_read_iov(fd, &tail, &ntail, 16, &vol);
+  const uint32_t tailblock=(tail.data-vol.flash)/(vol.chunk_size*vol.chunks_per_block);
+  printf("[?] buffered append %s in the cold stream\n",
+         (ntail==1 && tailblock==vol.append_block[2])?"lands":"does not land");
+  stfs_close(fd, &vol);
+#endif
+
+#ifdef STFS_INDEX
+  printf("[i] writing 64KB file (indexed)\n");
+#else
+  printf("[i] writing 64KB file (no index)\n");
+#endif
+  double start=now();
+  uint64_t busy=nor.busy_ns;
+  fd=stfs_open(testfilebig, O_CREAT, &vol);
   printf("[?] open %s o_creat returns %d\n", testfilebig, fd);
 
   // write data
   for(i=0;i<256;i++) {
     //printf("[x] %dth write", i);
-    ret=stfs_write(fd, data0, i<255?256:255, blocks);
+    ret=stfs_write(fd, data0, i<255?256:255, &vol);
     if((i<255 && ret!=256) || (i==255 && ret!=255)) {
       // fail to write
       printf("256 returns %d\n", ret);
       break;
     }
   }
-  printf("[?] close returns %d\n",stfs_close(fd, blocks));
+  printf("[?] close returns %d\n",stfs_close(fd, &vol));
+  double elapsed=now()-start;
+  printf("[i] write took %.2fms, %.1fKB/s\n", elapsed*1000, 64/elapsed);
+  // the cpu would wait for the flash on top
+  elapsed+=(nor.busy_ns-busy)/1e9;
+  printf("[i] write on nor flash took %.2fms, %.1fKB/s\n", elapsed*1000, 64/elapsed);
 
   printf("[i] reading 64KB file\n");
-  fd=stfs_open(testfilebig, 0, blocks);
+  start=now();
+  fd=stfs_open(testfilebig, 0, &vol);
   printf("[?] open %s returns %d\n", testfilebig, fd);
 
   // read data
   int cnt=0;
   for(i=0;i<256;i++) {
     //printf("[x] %dth read\n", i);
-    ret = stfs_read(fd, data0r, i<255?256:255, blocks);
+    ret = stfs_read(fd, data0r, i<255?256:255, &vol);
     if(i<255 && ret!=256) {
       printf("[x] short read: %d\n", ret);
     } else if(i==255) {
@@ -247,7 +318,136 @@ int main(void) {
     }
   }
   printf("[i] total read: %d\n", cnt);
-  printf("[?] close returns %d\n",stfs_close(fd, blocks));
+  printf("[?] close returns %d\n",stfs_close(fd, &vol));
+  elapsed=now()-start;
+  printf("[i] read took %.2fms, %.1fKB/s\n", elapsed*1000, 64/elapsed);
+
+  // keep rewriting the 64KB file so the device has to be vacuumed,
+  // first only by the synchronous vacuum in write, then by calling
+  // stfs_vacuum_step() after each write as an idle hook would
+  int pass, round;
+  for(pass=0;pass<2;pass++) {
+    double worst=0, worstflash=0;
+    uint32_t worstprog=0;
+    int steps=0;
+    programmed(blocks);
+    for(round=0;round<24;round++) {
+      fd=stfs_open(testfilebig, 0, &vol);
+      for(i=0;i<255;i++) {
+        start=now();
+        busy=nor.busy_ns;
+        ret=stfs_write(fd, data0, 256, &vol);
+        elapsed=now()-start;
+        if(elapsed+(nor.busy_ns-busy)/1e9>worstflash) worstflash=elapsed+(nor.busy_ns-busy)/1e9;
+        if(ret!=256) printf("[x] rewrite returns %d\n", ret);
+        if(elapsed>worst) worst=elapsed;
+        nprog=programmed(blocks);
+        if(nprog>worstprog) worstprog=nprog;
+        if(pass==1 && stfs_vacuum_step(&vol, 16)>0) steps++;
+        programmed(blocks);
+      }
+      stfs_close(fd, &vol);
+    }
+    printf("[i] %s: worst write programmed %d chunks in %.3fms (%.3fms on nor flash), %d steps left work\n",
+           pass?"vacuum steps of 16 chunks":"synchronous vacuum", worstprog, worst*1000, worstflash*1000, steps);
+  }
+
+  // remount the populated fs
+  STFS_MountInfo minfo;
+  start=now();
+  ret=stfs_mount(&vol, &flash, &minfo);
+  elapsed=now()-start;
+  printf("[?] mount returns %d, visited %d of %d chunks in %.3fms, %d free blocks\n",
+         ret, minfo.chunks_visited, NBLOCKS*CHUNKS_PER_BLOCK, elapsed*1000, minfo.free_blocks);
+  fd=stfs_open(testfilebig, 0, &vol);
+  ret=stfs_read(fd, data0r, 256, &vol);
+  if(ret!=256 || memcmp(data0, data0r, 256)!=0) {
+    printf("[x] fail to read after remount\n");
+  }
+  printf("[?] close returns %d\n",stfs_close(fd, &vol));
+
+  printf("[i] nor flash: %d programs (%dB changed), %d erases, busy %.1fms, %d rejected programs\n",
+         nor.programs, nor.programmed, nor.erases, nor.busy_ns/1e6, nor.violations);
+
+  // a second, smaller volume in RAM next to the first one, the same
+  // path on both must keep its own content
+  static uint8_t small[4*64*CHUNK_SIZE];
+  STFS_Volume vol2={small, CHUNK_SIZE, 64, 4};
+  uint8_t other[256];
+  memset(small,0xff,sizeof(small));
+  memset(other,0xa5,sizeof(other));
+  printf("[?] mount second volume returns %d\n", stfs_mount(&vol2, NULL, NULL));
+  int fd2=stfs_open(testfilebig, O_CREAT, &vol2);
+  fd=stfs_open(testfilebig, 0, &vol);
+  for(i=0;i<16;i++) {
+    stfs_write(fd, data0, 256, &vol);
+    stfs_write(fd2, other, 256, &vol2);
+  }
+  stfs_close(fd, &vol);
+  stfs_close(fd2, &vol2);
+  fd2=stfs_open(testfilebig, 0, &vol2);
+  ret=stfs_read(fd2, data0r, 256, &vol2);
+  if(ret!=256 || memcmp(other, data0r, 256)!=0 || stfs_size(fd2, &vol2)!=16*256) {
+    printf("[x] second volume mixed up with the first\n");
+  }
+  printf("[?] close second volume returns %d\n", stfs_close(fd2, &vol2));
+
+  // a snapshot keeps reading the file as it was while it is rewritten
+  // until the volume has to be vacuumed, releasing it frees the blocks
+  STFS_Snapshot snap;
+  STFS_ChunkRef refs[16*256/DATA_PER_CHUNK+1];
+  uint8_t newer[256];
+  uint32_t rewrites=0;
+  memset(newer,0x3c,sizeof(newer));
+  printf("[?] snapshot returns %d\n", stfs_snapshot(&vol2, testfilebig, &snap, refs, sizeof(refs)/sizeof(refs[0])));
+  for(round=0;round<8;round++) {
+    fd2=stfs_open(testfilebig, 0, &vol2);
+    for(i=0;i<16 && stfs_write(fd2, newer, 256, &vol2)==256;i++) rewrites++;
+    stfs_close(fd2, &vol2);
+  }
+  for(i=0,cnt=0;i<16;i++) {
+    if(stfs_snapshot_read(&snap, i*256, data0r, 256)==256 && memcmp(other, data0r, 256)==0) cnt++;
+  }
+  printf("[i] snapshot read %d of 16 pieces unchanged after %d rewrites\n", cnt, rewrites);
+  stfs_snapshot_release(&snap);
+  fd2=stfs_open(testfilebig, 0, &vol2);
+  for(i=0;i<16 && stfs_write(fd2, newer, 256, &vol2)==256;i++);
+  printf("[?] rewrite after release %s\n", (i==16)?"succeeds":"fails");
+  stfs_close(fd2, &vol2);
+
+  // stfs_read_iov points to the bytes in flash instead of copying them
+  STFS_Segment segs[256/DATA_PER_CHUNK+2];
+  uint32_t nsegs=sizeof(segs)/sizeof(segs[0]), seg;
+  fd2=stfs_open(testfilebig, 0, &vol2);
+  const uint32_t gen=stfs_generation(&vol2);
+  ret=stfs_read_iov(fd2, segs, &nsegs, 256, &vol2);
+  for(seg=0,cnt=0;seg<nsegs && memcmp(segs[seg].data, newer+cnt, segs[seg].len)==0;cnt+=segs[seg++].len);
+  printf("[?] read_iov returns %d in %d segments, %s\n", ret, nsegs,
+         (seg==nsegs && cnt==256 && stfs_generation(&vol2)==gen)?"matching":"mismatching");
+  stfs_close(fd2, &vol2);
+
+  // remounting in the middle of an incremental vacuum, as after a
+  // reset, leaves no empty block, mount finishes a vacuum to get one
+  STFS_BlockInfo binfo;
+  uint32_t empty=1, b;
+  for(round=0;round<64;round++) {
+    fd2=stfs_open(testfilebig, 0, &vol2);
+    for(i=0;i<16;i++) stfs_write(fd2, other, 256, &vol2);
+    stfs_close(fd2, &vol2);
+    if(stfs_vacuum_step(&vol2, 4)!=1) continue;
+    for(b=0,empty=0;b<4;b++) {
+      if(stfs_blockinfo(&vol2, b, &binfo)==0 && binfo.live==0 && binfo.deleted==0) empty++;
+    }
+    if(empty==0) break;
+  }
+  ret=stfs_mount(&vol2, NULL, &minfo);
+  printf("[?] remount mid vacuum with %d empty blocks returns %d\n", empty, ret);
+  fd2=stfs_open(testfilebig, 0, &vol2);
+  for(i=0,cnt=0;i<16;i++) {
+    if(stfs_read(fd2, data0r, 256, &vol2)==256 && memcmp(other, data0r, 256)==0) cnt++;
+  }
+  printf("[i] read %d of 16 pieces after the remount\n", cnt);
+  stfs_close(fd2, &vol2);
 
   fd=open("test.img", O_RDWR | O_CREAT | O_TRUNC, 0666 );
   printf("[i] dumping fs to fd %d\n", fd);
@@ -0,0 +1,152 @@
+#include "stfs.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// replays the same write trace under every vacuum victim policy and
+// reports the erases and chunk copies caused per written byte, and the
+// difference between the most and least erased block.
+//
+// usage: vacsim [-c percent] [trace]
+//
+// a trace has one write per line: <file> <offset> <length>, files are
+// numbered 0..NFILES-1. without a trace a hot/cold workload is
+// generated: most writes go to a few small hot files, percent (default
+// 10) of them to large cold files that fill most of the device. with
+// -c 0 the cold files are written once, like firmware images.
+
+#define NFILES 28
+#define NHOT 4
+#define HOT_SIZE (32*DATA_PER_CHUNK)
+#define COLD_SIZE (128*DATA_PER_CHUNK)
+#define MAX_OPS 65536
+#define MAX_TRACE_FILE_SIZE 0xffff // files of traces are limited to this
+
+typedef struct {
+  uint16_t file;
+  uint16_t len;
+  uint32_t offset;
+} Op;
+
+static Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK];
+static STFS_Volume vol=STFS_VOLUME(blocks);
+static Op trace[MAX_OPS];
+static uint32_t nops;
+static uint32_t file_size[NFILES];
+static uint8_t data[MAX_TRACE_FILE_SIZE];
+static uint32_t cold_percent=10;
+
+static const struct {
+  const char *name;
+  STFS_VictimPolicy policy;
+} policies[] = {
+  {"greedy", stfs_victim_greedy},
+  {"deterministic", stfs_victim_deterministic},
+  {"cost-benefit", stfs_victim_cost_benefit},
+};
+
+static uint32_t lcg(void) {
+  static uint32_t state=1;
+  state=state*1103515245+12345;
+  return state>>8;
+}
+
+static void generate(void) {
+  uint32_t i;
+  for(i=0;i<NFILES;i++) file_size[i]=(i<NHOT)?HOT_SIZE:COLD_SIZE;
+  for(nops=0;nops<40000;nops++) {
+    Op *op=&trace[nops];
+    op->file=(lcg()%100<cold_percent)?NHOT+lcg()%(NFILES-NHOT):lcg()%NHOT;
+    op->len=DATA_PER_CHUNK*(1+lcg()%4);
+    op->offset=(lcg()%(file_size[op->file]/DATA_PER_CHUNK))*DATA_PER_CHUNK;
+    if(op->offset+op->len>file_size[op->file]) op->offset=file_size[op->file]-op->len;
+  }
+}
+
+static int load(const char *path) {
+  FILE *fp=fopen(path, "r");
+  unsigned file, offset, len;
+  if(fp==NULL) return -1;
+  memset(file_size,0,sizeof(file_size));
+  for(nops=0;nops<MAX_OPS && fscanf(fp, "%u %u %u", &file, &offset, &len)==3;) {
+    if(file>=NFILES || len==0 || offset+len>MAX_TRACE_FILE_SIZE) continue;
+    trace[nops].file=file;
+    trace[nops].offset=offset;
+    trace[nops].len=len;
+    if(offset+len>file_size[file]) file_size[file]=offset+len;
+    nops++;
+  }
+  fclose(fp);
+  return 0;
+}
+
+static int write_at(uint32_t file, uint32_t offset, uint32_t len) {
+  char path[16];
+  snprintf(path, sizeof(path), "/f%d", file);
+  int fd=stfs_open((uint8_t*) path, O_CREAT, &vol);
+  if(fd<0) fd=stfs_open((uint8_t*) path, 0, &vol);
+  if(fd<0) return -1;
+  if(stfs_lseek(fd, offset, SEEK_SET, &vol)!=offset ||
+     stfs_write(fd, data, len, &vol)!=len) {
+    stfs_close(fd, &vol);
+    return -1;
+  }
+  return stfs_close(fd, &vol);
+}
+
+int main(int argc, char **argv) {
+  uint32_t i, p;
+  int arg=1;
+  if(argc>arg+1 && strcmp(argv[arg], "-c")==0) {
+    cold_percent=atoi(argv[arg+1]);
+    arg+=2;
+  }
+  if(argc>arg) {
+    if(load(argv[arg])!=0) {
+      perror(argv[arg]);
+      return 1;
+    }
+  } else {
+    generate();
+  }
+  memset(data,0x5a,sizeof(data));
+
+  printf("STFS_STREAMS=%d\n", STFS_STREAMS);
+  printf("%-14s %8s %8s %10s %12s %7s\n", "policy", "erases", "copies", "copies/KB", "erases/MB", "spread");
+  for(p=0;p<sizeof(policies)/sizeof(policies[0]);p++) {
+    STFS_VacuumStats before, after;
+    uint64_t bytes=0;
+    memset(blocks,0xff,sizeof(blocks));
+    srandom(1);
+    stfs_set_victim_policy(&vol, policies[p].policy);
+    if(stfs_init(&vol)!=0) return 1;
+    // files are written in full before the trace is replayed, so
+    // overwrites within the file never extend it
+    for(i=0;i<NFILES;i++) {
+      if(file_size[i]>0 && write_at(i, 0, file_size[i])!=0) {
+        printf("[x] %s: failed to create file %d\n", policies[p].name, i);
+        return 1;
+      }
+    }
+    stfs_vacuum_stats(&vol, &before);
+    for(i=0;i<nops;i++) {
+      if(write_at(trace[i].file, trace[i].offset, trace[i].len)!=0) {
+        printf("[x] %s: write %d failed, errno %d\n", policies[p].name, i, stfs_geterrno(&vol));
+        break;
+      }
+      bytes+=trace[i].len;
+    }
+    stfs_vacuum_stats(&vol, &after);
+    const uint32_t erases=after.erases-before.erases, copies=after.copies-before.copies;
+    uint32_t min_erases=0xffffffff, max_erases=0;
+    for(i=0;i<NBLOCKS;i++) {
+      STFS_BlockInfo info;
+      stfs_blockinfo(&vol, i, &info);
+      if(info.erases<min_erases) min_erases=info.erases;
+      if(info.erases>max_erases) max_erases=info.erases;
+    }
+    printf("%-14s %8d %8d %10.2f %12.2f %7d\n", policies[p].name, erases, copies,
+           copies*1024.0/bytes, erases*1048576.0/bytes, max_erases-min_erases);
+  }
+  return 0;
+}